@@ -0,0 +1,573 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Loopback upload benchmark. Starts ./server as a child in a scratch
+// directory (tmpfs by default), generates the test files there and times
+// rounds of concurrent ./client uploads, so two builds of the transfer path
+// can be compared on the same machine without any disk or network in the way.
+// With -T every server variant also runs over TLS, against a throwaway
+// certificate, to show what encryption costs next to the plaintext path.
+
+using namespace std;
+namespace fs = std::filesystem;
+using Clock = chrono::steady_clock;
+
+constexpr size_t FILL_CHUNK = 1024 * 1024;
+constexpr uint64_t SPACE_MARGIN = 64 * 1024 * 1024;
+constexpr auto SERVER_START_TIMEOUT = chrono::seconds(5);
+
+struct Options {
+    fs::path dir = "/dev/shm/lab2-bench";
+    fs::path server = "./server";
+    fs::path client = "./client";
+    vector<uint64_t> sizes;
+    vector<int> levels;
+    vector<string> server_variants;
+    vector<string> client_variants;
+    int min_rounds = 3;
+    double min_seconds = 1.0;
+    bool sparse = false;
+    bool keep = false;
+    bool tls = false;
+    fs::path tls_pem;  // certificate and key for -t on both sides
+};
+
+// Resource use of a set of processes over some interval.
+struct Usage {
+    double cpu = 0;      // user + system seconds
+    uint64_t calls = 0;  // system calls, see syscall_source()
+};
+
+struct Cell {
+    uint64_t bytes = 0;
+    double wall = 0;
+    Usage client, server;
+    int rounds = 0;
+    bool failed = false;
+};
+
+uint64_t parse_size(const string& s) {
+    size_t end;
+    uint64_t n = stoull(s, &end);
+    switch (end < s.size() ? toupper(s[end]) : 0) {
+    case 'G':
+        n <<= 10;
+        [[fallthrough]];
+    case 'M':
+        n <<= 10;
+        [[fallthrough]];
+    case 'K':
+        n <<= 10;
+    }
+    return n;
+}
+
+string size_label(uint64_t n) {
+    const char* units[] = {"", "K", "M", "G", "T"};
+    int u = 0;
+    while (n >= 1024 && n % 1024 == 0 && u < 4) {
+        n /= 1024;
+        u++;
+    }
+    return to_string(n) + units[u];
+}
+
+vector<string> split(const string& s, char sep) {
+    vector<string> parts;
+    stringstream in(s);
+    string part;
+    while (getline(in, part, sep))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+// ---------- system call counting ----------
+//
+// With tracefs and enough privilege every syscall entry is counted through a
+// perf tracepoint that follows the process and all of its threads. Otherwise
+// the columns fall back to the read/write-family counts the kernel keeps in
+// /proc/<pid>/io (syscr + syscw), which miss send/recv/splice/epoll but still
+// move with the number of copies a transfer path makes.
+
+long syscall_tracepoint() {
+    static long id = [] {
+        for (const char* path : {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                                 "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"}) {
+            ifstream in(path);
+            long v;
+            if (in >> v)
+                return v;
+        }
+        return -1L;
+    }();
+    return id;
+}
+
+int open_syscall_counter(pid_t pid) {
+    if (syscall_tracepoint() < 0)
+        return -1;
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.config = syscall_tracepoint();
+    attr.inherit = 1;
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+bool perf_works = false;
+
+const char* syscall_source() {
+    return perf_works ? "syscalls (perf raw_syscalls:sys_enter)"
+                      : "read/write-family syscalls (/proc/<pid>/io syscr+syscw)";
+}
+
+uint64_t proc_io_calls(pid_t pid) {
+    ifstream in("/proc/" + to_string(pid) + "/io");
+    string key;
+    uint64_t value, calls = 0;
+    while (in >> key >> value)
+        if (key == "syscr:" || key == "syscw:")
+            calls += value;
+    return calls;
+}
+
+struct Child {
+    pid_t pid = -1;
+    int counter = -1;
+
+    uint64_t calls() const {
+        uint64_t n;
+        if (counter >= 0 && read(counter, &n, sizeof(n)) == sizeof(n))
+            return n;
+        return proc_io_calls(pid);
+    }
+};
+
+// Forks and execs argv with stdout and stderr redirected. The child waits on
+// a pipe until the parent has attached the syscall counter, so the count
+// starts before exec and covers every thread the program creates.
+Child spawn(const vector<string>& args, const fs::path& cwd, int out_fd, int err_fd) {
+    int gate[2];
+    if (pipe2(gate, O_CLOEXEC) < 0)
+        throw runtime_error("pipe: " + string(strerror(errno)));
+
+    pid_t pid = fork();
+    if (pid < 0)
+        throw runtime_error("fork: " + string(strerror(errno)));
+    if (pid == 0) {
+        close(gate[1]);
+        char c;
+        while (read(gate[0], &c, 1) < 0 && errno == EINTR) {
+        }
+        if (!cwd.empty() && chdir(cwd.c_str()) < 0)
+            _exit(127);
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+        vector<char*> argv;
+        for (const string& a : args)
+            argv.push_back(const_cast<char*>(a.c_str()));
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    Child child;
+    child.pid = pid;
+    child.counter = open_syscall_counter(pid);
+    perf_works |= child.counter >= 0;
+    close(gate[0]);
+    close(gate[1]);
+    return child;
+}
+
+// Reaps a child, reading its syscall count while it is still a zombie.
+// Returns false if it did not exit with status 0.
+bool reap(Child& child, Usage& usage) {
+    siginfo_t info;
+    while (waitid(P_PID, child.pid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR) {
+    }
+    usage.calls += child.calls();
+
+    int status;
+    rusage ru;
+    while (wait4(child.pid, &status, 0, &ru) < 0 && errno == EINTR) {
+    }
+    usage.cpu += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+                 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    if (child.counter >= 0)
+        close(child.counter);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// CPU time a running process has used so far, all threads included.
+double cpu_seconds(pid_t pid) {
+    clockid_t cid;
+    timespec ts;
+    if (clock_getcpuclockid(pid, &cid) != 0 || clock_gettime(cid, &ts) != 0)
+        return 0;
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ---------- setup ----------
+
+int free_port() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (fd < 0 || ::bind(fd, (sockaddr*)&addr, len) < 0 || getsockname(fd, (sockaddr*)&addr, &len) < 0)
+        throw runtime_error("no free port: " + string(strerror(errno)));
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+bool wait_for_listener(const Child& server, int port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    auto deadline = Clock::now() + SERVER_START_TIMEOUT;
+    while (Clock::now() < deadline) {
+        if (waitpid(server.pid, nullptr, WNOHANG) != 0)
+            return false;
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool up = connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if (up)
+            return true;
+        this_thread::sleep_for(chrono::milliseconds(20));
+    }
+    return false;
+}
+
+void make_file(const fs::path& path, uint64_t size, bool sparse) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw runtime_error(path.string() + ": " + strerror(errno));
+    if (sparse) {
+        if (ftruncate(fd, size) < 0)
+            throw runtime_error(path.string() + ": " + strerror(errno));
+    } else {
+        mt19937_64 rng(size);
+        vector<uint64_t> chunk(FILL_CHUNK / sizeof(uint64_t));
+        for (uint64_t done = 0; done < size;) {
+            for (auto& word : chunk)
+                word = rng();
+            size_t n = min<uint64_t>(FILL_CHUNK, size - done);
+            if (write(fd, chunk.data(), n) != (ssize_t)n)
+                throw runtime_error(path.string() + ": " + strerror(errno));
+            done += n;
+        }
+    }
+    close(fd);
+}
+
+// Client i uploads its own symlink to the shared source file, so
+// concurrent uploads land under different names on the server.
+fs::path client_link(const Options& o, uint64_t size, int i) {
+    return o.dir / "files" / ("f" + size_label(size) + "." + to_string(i));
+}
+
+uint64_t free_space(const fs::path& dir) {
+    struct statvfs st;
+    return statvfs(dir.c_str(), &st) == 0 ? (uint64_t)st.f_bavail * st.f_frsize : 0;
+}
+
+// ---------- measurement ----------
+
+// Self-signed, for 127.0.0.1, through the openssl command line tool.
+bool make_certificate(Options& o, int null_fd) {
+    o.tls_pem = o.dir / "tls.pem";
+    fs::path cert = o.dir / "tls.crt";
+    Child req = spawn({"openssl", "req", "-x509", "-newkey", "ec", "-pkeyopt",
+                       "ec_paramgen_curve:prime256v1", "-nodes", "-days", "1", "-subj", "/CN=lab2-bench",
+                       "-addext", "subjectAltName=IP:127.0.0.1", "-keyout", o.tls_pem.string(),
+                       "-out", cert.string()},
+                      {}, null_fd, null_fd);
+    Usage ignored;
+    if (!reap(req, ignored))
+        return false;
+    ifstream in(cert);
+    ofstream out(o.tls_pem, ios::app);
+    return bool(out << in.rdbuf());
+}
+
+// The line the server logs once it knows whether the kernel took over the
+// TLS records, if it logged one after `from`.
+string tls_mode(const fs::path& log, streamoff from) {
+    ifstream in(log);
+    in.seekg(from);
+    string line;
+    while (getline(in, line))
+        if (line.find("kTLS") != string::npos)
+            return line;
+    return "no TLS connection completed";
+}
+
+bool run_round(const Options& o, const Child& server, int port, const string& client_flags,
+               bool tls, uint64_t size, int level, Cell& cell, int null_fd) {
+    vector<string> base = {o.client.string()};
+    for (const string& flag : split(client_flags, ' '))
+        base.push_back(flag);
+    if (tls) {
+        base.push_back("-t");
+        base.push_back(o.tls_pem.string());
+    }
+
+    double server_cpu = cpu_seconds(server.pid);
+    uint64_t server_calls = server.calls();
+    auto t0 = Clock::now();
+
+    vector<Child> clients;
+    for (int i = 0; i < level; i++) {
+        vector<string> args = base;
+        args.push_back(client_link(o, size, i).string());
+        args.push_back("127.0.0.1");
+        args.push_back(to_string(port));
+        clients.push_back(spawn(args, {}, null_fd, null_fd));
+    }
+    bool ok = true;
+    for (Child& c : clients)
+        ok &= reap(c, cell.client);
+
+    cell.wall += chrono::duration<double>(Clock::now() - t0).count();
+    cell.server.cpu += cpu_seconds(server.pid) - server_cpu;
+    cell.server.calls += server.calls() - server_calls;
+    cell.bytes += size * level;
+    cell.rounds++;
+
+    error_code ec;
+    fs::remove_all(o.dir / "server" / "uploads", ec);
+    return ok;
+}
+
+void print_header() {
+    cout << left << setw(14) << "server" << setw(14) << "client" << right
+         << setw(6) << "size" << setw(6) << "conc" << setw(8) << "rounds"
+         << setw(10) << "MB/s"
+         << setw(14) << "cli cpu s/GB" << setw(14) << "srv cpu s/GB"
+         << setw(14) << "cli calls/MB" << setw(14) << "srv calls/MB" << "\n";
+}
+
+void print_cell(const string& server_label, const string& client_flags, uint64_t size,
+                int level, const Cell& cell, const char* note) {
+    cout << left << setw(14) << server_label
+         << setw(14) << (client_flags.empty() ? "-" : client_flags) << right
+         << setw(6) << size_label(size) << setw(6) << level;
+    if (note) {
+        cout << "  " << note << "\n";
+        return;
+    }
+    double mb = cell.bytes / 1e6, gb = cell.bytes / 1e9;
+    cout << setw(8) << cell.rounds << fixed << setprecision(1)
+         << setw(10) << mb / cell.wall << setprecision(3)
+         << setw(14) << cell.client.cpu / gb << setw(14) << cell.server.cpu / gb
+         << setprecision(1)
+         << setw(14) << cell.client.calls / mb << setw(14) << cell.server.calls / mb
+         << defaultfloat << "\n";
+}
+
+void run_variant(const Options& o, const string& server_flags, bool tls, int null_fd) {
+    int port = free_port();
+    vector<string> args = {o.server.string()};
+    for (const string& flag : split(server_flags, ' '))
+        args.push_back(flag);
+    if (tls) {
+        args.push_back("-t");
+        args.push_back(o.tls_pem.string());
+    }
+    args.push_back(to_string(port));
+    string label = server_flags.empty() ? (tls ? "tls" : "-") : server_flags + (tls ? " tls" : "");
+
+    fs::path log = o.dir / "server.log";
+    error_code ec;
+    streamoff log_start = fs::exists(log) ? (streamoff)fs::file_size(log, ec) : 0;
+    int log_fd = open(log.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    // stdout too: with -T it says whether the kernel took the TLS records
+    Child server = spawn(args, o.dir / "server", log_fd < 0 ? null_fd : log_fd,
+                         log_fd < 0 ? null_fd : log_fd);
+    if (log_fd >= 0)
+        close(log_fd);
+
+    if (!wait_for_listener(server, port)) {
+        cerr << "server " << label << " did not come up, see " << log << "\n";
+        kill(server.pid, SIGKILL);
+        Usage ignored;
+        reap(server, ignored);
+        return;
+    }
+
+    for (const string& client_flags : o.client_variants) {
+        for (uint64_t size : o.sizes) {
+            for (int level : o.levels) {
+                // source + one copy per concurrent upload on the server side
+                if (size * level + SPACE_MARGIN > free_space(o.dir)) {
+                    print_cell(label, client_flags, size, level, {},
+                               "skipped: not enough space in the scratch directory");
+                    continue;
+                }
+                Cell cell;
+                auto start = Clock::now();
+                while (cell.rounds < o.min_rounds
+                       || chrono::duration<double>(Clock::now() - start).count() < o.min_seconds) {
+                    if (!run_round(o, server, port, client_flags, tls, size, level, cell, null_fd)) {
+                        cell.failed = true;
+                        break;
+                    }
+                }
+                print_cell(label, client_flags, size, level, cell,
+                           cell.failed ? "FAILED, see server.log" : nullptr);
+            }
+        }
+    }
+
+    kill(server.pid, SIGTERM);
+    Usage ignored;
+    reap(server, ignored);
+    if (tls)
+        cout << "  " << label << ": " << tls_mode(log, log_start) << "\n";
+}
+
+void usage() {
+    cerr << "Usage: bench [-d dir] [-b sizes] [-j levels] [-v server_flags]... [-x client_flags]...\n"
+         << "             [-n rounds] [-t seconds] [-S server] [-C client] [-T] [-z] [-k]\n"
+         << "  -d  scratch directory, ideally on tmpfs (default /dev/shm/lab2-bench)\n"
+         << "  -b  file sizes, e.g. 1K,1M,64M,1G,10G (default 1K,1M,64M,256M)\n"
+         << "  -j  concurrent clients per round, e.g. 1,4,16 (default 1,4,8)\n"
+         << "  -v  server flags to compare, repeatable, e.g. -v '' -v -c -v '-a -f end'\n"
+         << "  -x  client flags to compare, repeatable, e.g. -x '' -x '-s 4' -x '-z zstd'\n"
+         << "  -n  at least this many rounds per cell (default 3)\n"
+         << "  -t  and at least this many seconds per cell (default 1)\n"
+         << "  -S, -C  server and client binaries (default ./server, ./client)\n"
+         << "  -T  run every server variant over TLS as well (needs the openssl tool)\n"
+         << "  -z  sparse test files instead of random data\n"
+         << "  -k  keep the scratch directory\n";
+}
+
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+
+    Options o;
+    string sizes = "1K,1M,64M,256M", levels = "1,4,8";
+    bool bad_args = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:C:d:j:kn:S:t:Tv:x:z")) != -1) {
+        if (opt == 'b')
+            sizes = optarg;
+        else if (opt == 'C')
+            o.client = optarg;
+        else if (opt == 'd')
+            o.dir = optarg;
+        else if (opt == 'j')
+            levels = optarg;
+        else if (opt == 'k')
+            o.keep = true;
+        else if (opt == 'n')
+            o.min_rounds = max(1, atoi(optarg));
+        else if (opt == 'S')
+            o.server = optarg;
+        else if (opt == 't')
+            o.min_seconds = atof(optarg);
+        else if (opt == 'T')
+            o.tls = true;
+        else if (opt == 'v')
+            o.server_variants.push_back(optarg);
+        else if (opt == 'x')
+            o.client_variants.push_back(optarg);
+        else if (opt == 'z')
+            o.sparse = true;
+        else
+            bad_args = true;
+    }
+
+    try {
+        for (const string& s : split(sizes, ','))
+            o.sizes.push_back(parse_size(s));
+        for (const string& s : split(levels, ','))
+            o.levels.push_back(max(1, stoi(s)));
+    } catch (const exception&) {
+        bad_args = true;
+    }
+    if (bad_args || optind != argc || o.sizes.empty() || o.levels.empty()) {
+        usage();
+        return 1;
+    }
+    if (o.server_variants.empty())
+        o.server_variants.push_back("");
+    if (o.client_variants.empty())
+        o.client_variants.push_back("");
+
+    // children chdir into the scratch directory
+    o.server = fs::absolute(o.server);
+    o.client = fs::absolute(o.client);
+    if (access(o.server.c_str(), X_OK) < 0 || access(o.client.c_str(), X_OK) < 0) {
+        cerr << "Build server and client first, or point -S/-C at them\n";
+        return 1;
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    try {
+        fs::remove_all(o.dir);
+        fs::create_directories(o.dir / "files");
+        fs::create_directories(o.dir / "server");
+        if (o.tls && !make_certificate(o, null_fd))
+            throw runtime_error("cannot create a TLS certificate with the openssl tool");
+
+        int max_level = *max_element(o.levels.begin(), o.levels.end());
+        for (uint64_t size : o.sizes) {
+            fs::path source = o.dir / "files" / ("f" + size_label(size));
+            if (size + SPACE_MARGIN > free_space(o.dir)) {
+                cerr << "not enough space in " << o.dir << " for a " << size_label(size)
+                     << " file, dropping it\n";
+                continue;
+            }
+            make_file(source, size, o.sparse);
+            for (int i = 0; i < max_level; i++)
+                fs::create_symlink(source, client_link(o, size, i));
+        }
+        o.sizes.erase(remove_if(o.sizes.begin(), o.sizes.end(),
+                                [&](uint64_t size) { return !fs::exists(o.dir / "files" / ("f" + size_label(size))); }),
+                      o.sizes.end());
+
+        cout << "scratch " << o.dir << ", " << (o.sparse ? "sparse" : "random") << " files, "
+             << thread::hardware_concurrency() << " CPUs\n";
+        print_header();
+        for (const string& server_flags : o.server_variants) {
+            run_variant(o, server_flags, false, null_fd);
+            if (o.tls)
+                run_variant(o, server_flags, true, null_fd);
+        }
+        cout << "calls/MB counts " << syscall_source() << "\n";
+    } catch (const exception& e) {
+        cerr << e.what() << "\n";
+        return 1;
+    }
+
+    if (!o.keep)
+        fs::remove_all(o.dir);
+    return 0;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+
+// Content-defined chunking for OP_DEDUP. Cut points are chosen by a gear
+// rolling hash over the bytes just before them (FastCDC), so an insert or
+// delete only moves the boundaries near it: the chunks, and their ids,
+// around an edit stay the same and a repeat upload finds them in the
+// server's chunk store.
+
+// Two XXH64 with different seeds. The server checks every chunk it
+// receives against its id, and the upload's whole-file hash catches the
+// rare reuse of a stored chunk under a colliding id.
+struct ChunkId {
+    uint64_t lo = 0, hi = 0;
+
+    bool operator==(const ChunkId& o) const { return lo == o.lo && hi == o.hi; }
+
+    std::string hex() const {
+        char s[33];
+        snprintf(s, sizeof(s), "%016llx%016llx", (unsigned long long)hi, (unsigned long long)lo);
+        return s;
+    }
+};
+
+constexpr uint64_t CHUNK_ID_SEED = 0x9E3779B97F4A7C15;
+
+inline ChunkId chunk_id(const void* data, size_t len) {
+    return {Xxh64::hash(data, len), Xxh64::hash(data, len, CHUNK_ID_SEED)};
+}
+
+// Reads a file sequentially and hands it out chunk by chunk.
+class Chunker {
+public:
+    static constexpr size_t MIN_SIZE = 16 * 1024;
+    static constexpr size_t AVG_SIZE = 64 * 1024;
+    static constexpr size_t MAX_SIZE = 256 * 1024;
+
+    explicit Chunker(int fd) : fd_(fd), buf_(READ_SIZE + MAX_SIZE) {}
+
+    // Points `data` at the next chunk, valid until the next call. Returns
+    // false at the end of the file or on a read error; see failed().
+    bool next(const char*& data, size_t& len) {
+        if (end_ - pos_ < MAX_SIZE && !eof_)
+            refill();
+        if (pos_ == end_)
+            return false;
+        len = cut(reinterpret_cast<const uint8_t*>(buf_.data() + pos_), end_ - pos_);
+        data = buf_.data() + pos_;
+        pos_ += len;
+        return true;
+    }
+
+    bool failed() const { return failed_; }
+
+private:
+    static constexpr size_t READ_SIZE = 4 * 1024 * 1024;
+    // Normalized chunking: a stricter mask below AVG_SIZE and a looser one
+    // above it pull chunk sizes toward the average. The gear hash shifts
+    // left, so its top bits depend on the most bytes.
+    static constexpr uint64_t MASK_SMALL = 0xFFFF800000000000;  // 17 bits
+    static constexpr uint64_t MASK_LARGE = 0xFFFE000000000000;  // 15 bits
+
+    static const std::array<uint64_t, 256>& gear() {
+        static const std::array<uint64_t, 256> table = [] {
+            std::array<uint64_t, 256> t{};
+            uint64_t x = 0x4C32434443;  // fixed, so every client cuts alike
+            for (auto& v : t) {
+                // splitmix64
+                uint64_t z = (x += 0x9E3779B97F4A7C15);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+                v = z ^ (z >> 31);
+            }
+            return t;
+        }();
+        return table;
+    }
+
+    static size_t cut(const uint8_t* p, size_t n) {
+        if (n <= MIN_SIZE)
+            return n;
+        const auto& g = gear();
+        size_t normal = std::min(n, AVG_SIZE);
+        size_t end = std::min(n, MAX_SIZE);
+        uint64_t h = 0;
+        size_t i = MIN_SIZE;
+        for (; i < normal; i++) {
+            h = (h << 1) + g[p[i]];
+            if (!(h & MASK_SMALL))
+                return i + 1;
+        }
+        for (; i < end; i++) {
+            h = (h << 1) + g[p[i]];
+            if (!(h & MASK_LARGE))
+                return i + 1;
+        }
+        return end;
+    }
+
+    void refill() {
+        memmove(buf_.data(), buf_.data() + pos_, end_ - pos_);
+        end_ -= pos_;
+        pos_ = 0;
+        while (end_ < buf_.size()) {
+            ssize_t r = read(fd_, buf_.data() + end_, buf_.size() - end_);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                failed_ = r < 0;
+                eof_ = true;
+                return;
+            }
+            end_ += r;
+        }
+    }
+
+    int fd_;
+    std::vector<char> buf_;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+    bool eof_ = false;
+    bool failed_ = false;
+};
@@ -1,47 +1,877 @@
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
 #include <vector>
 #include <cstring>
 
+#include "bounded_queue.h"
+#include "chunker.h"
+#include "codec.h"
+#include "hash.h"
+#include "protocol.h"
+#include "socket_tuner.h"
+#include "tls.h"
+
 using namespace std;
 namespace fs = std::filesystem;
 
-uint64_t htonll(uint64_t x) {
-    if (htonl(1) != 1)
-        return ((uint64_t)htonl(x & 0xFFFFFFFF) << 32) | htonl(x >> 32);
-    return x;
+constexpr size_t BUF_SIZE = 64 * 1024;
+constexpr size_t SENDFILE_CHUNK = 1 << 30;
+constexpr size_t HASH_CHUNK = 1024 * 1024;
+constexpr int MAX_RESUME_ATTEMPTS = 10;
+constexpr size_t FRAME_CHUNK = 256 * 1024;
+constexpr size_t PIPELINE_DEPTH = 16;
+constexpr uint64_t SKIP_AFTER_MISS = 16;
+constexpr size_t MAX_UNACKED_FILES = 1024;
+
+SSL_CTX* tls_ctx = nullptr;  // -t
+const char* congestion = nullptr;  // -C
+string tls_host;             // name or address the certificate must match
+
+// Runs the TLS handshake on a connected socket. Returns the socket itself
+// once the kernel took over the records, the local end of a user-space
+// relay otherwise, or -1 after closing `sock` on failure.
+int start_tls(int sock) {
+    tls_nodelay(sock, true);
+    SSL* ssl = SSL_new(tls_ctx);
+    in_addr ip;
+    bool by_ip = inet_pton(AF_INET, tls_host.c_str(), &ip) == 1;
+    bool ok = ssl && SSL_set_fd(ssl, sock)
+              && (by_ip ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), tls_host.c_str())
+                        : SSL_set1_host(ssl, tls_host.c_str()) && SSL_set_tlsext_host_name(ssl, tls_host.c_str()));
+    if (ok && SSL_connect(ssl) == 1) {
+        if (tls_offloaded(ssl)) {
+            SSL_free(ssl);
+            tls_nodelay(sock, false);
+            return sock;
+        }
+        int local = tls_relay(ssl, sock, 0);
+        if (local >= 0)
+            return local;
+        perror("TLS relay");
+    } else if (ssl && SSL_get_verify_result(ssl) != X509_V_OK) {
+        cerr << "TLS: " << X509_verify_cert_error_string(SSL_get_verify_result(ssl)) << "\n";
+    } else {
+        cerr << "TLS: " << tls_error() << "\n";
+    }
+    SSL_free(ssl);
+    close(sock);
+    return -1;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        cerr << "Usage: client <file_path> <host> <port>\n";
-        return 1;
+int connect_to(const sockaddr_in& addr) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (congestion && !set_congestion(sock, congestion)) {
+        cerr << "Congestion control " << congestion << ": " << strerror(errno) << "\n";
+        close(sock);
+        return -1;
     }
+    if (connect(sock, (const sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+    return tls_ctx ? start_tls(sock) : sock;
+}
 
-    fs::path file_path = argv[1];
-    string host = argv[2];
-    int port = stoi(argv[3]);
+bool send_file_copy(int sock, int file_fd, uint64_t offset, uint64_t length) {
+    vector<char> buf(BUF_SIZE);
+    uint64_t sent = 0;
+    while (sent < length) {
+        ssize_t r = pread(file_fd, buf.data(),
+                          min<uint64_t>(BUF_SIZE, length - sent), offset + sent);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            cerr << "Read error at offset " << offset + sent << "\n";
+            return false;
+        }
+        if (!send_all(sock, buf.data(), r))
+            return false;
+        sent += r;
+    }
+    return true;
+}
 
-    if (!fs::exists(file_path)) {
-        cerr << "File does not exist\n";
-        return 1;
+// Sends [offset, offset + length) of the file straight from the page cache.
+// sendfile() may move fewer bytes than asked, so it is called until the whole
+// range is out; filesystems without sendfile support fall back to pread/send.
+bool send_file_range(int sock, int file_fd, uint64_t offset, uint64_t length) {
+    off_t pos = offset;
+    uint64_t left = length;
+    while (left > 0) {
+        ssize_t n = sendfile(sock, file_fd, &pos, min<uint64_t>(left, SENDFILE_CHUNK));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS) && left == length)
+            return send_file_copy(sock, file_fd, offset, length);
+        if (n < 0) {
+            perror("sendfile");
+            return false;
+        }
+        if (n == 0) {
+            cerr << "File truncated at offset " << pos << "\n";
+            return false;
+        }
+        left -= n;
     }
+    return true;
+}
 
-    uint64_t file_size = fs::file_size(file_path);
-    string filename = file_path.filename().string();
+// Sends the range like send_file_range(), hashing each chunk just before it
+// goes out. Hashing reads the chunk back through the page cache, sending
+// still goes through sendfile(). If the file changes under us, the hash no
+// longer matches what was sent and the server rejects the upload. Chunks
+// grow past HASH_CHUNK when the path's bandwidth-delay product calls for it.
+bool send_file_hashed(int sock, int file_fd, uint64_t offset, uint64_t length, Xxh64& hash) {
+    SocketTuner tuner(sock, true);
+    vector<char> buf(HASH_CHUNK);
+    uint64_t end = offset + length;
+    for (uint64_t pos = offset; pos < end;) {
+        if (buf.size() < tuner.chunk())
+            buf.resize(tuner.chunk());
+        ssize_t r = pread(file_fd, buf.data(), min<uint64_t>(buf.size(), end - pos), pos);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            cerr << "Read error at offset " << pos << "\n";
+            return false;
+        }
+        hash.update(buf.data(), r);
+        if (!send_file_range(sock, file_fd, pos, r))
+            return false;
+        tuner.add(r);
+        pos += r;
+    }
+    return true;
+}
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+bool upload_whole(const sockaddr_in& addr, const fs::path& file_path,
+                  const string& filename, uint64_t file_size) {
+    int file_fd = open(file_path.c_str(), O_RDONLY);
+    if (file_fd < 0) {
+        perror("open");
+        return false;
+    }
+    int sock = connect_to(addr);
     if (sock < 0) {
-        perror("socket");
+        close(file_fd);
+        return false;
+    }
+
+    Xxh64 hash;
+    bool ok = send_u32(sock, OP_UPLOAD) &&
+              send_u32(sock, filename.size()) &&
+              send_all(sock, filename.data(), filename.size()) &&
+              send_u64(sock, file_size) &&
+              send_file_hashed(sock, file_fd, 0, file_size, hash) &&
+              send_u64(sock, hash.digest());
+
+    uint8_t status = 0;
+    if (ok && !recv_all(sock, &status, sizeof(status)))
+        status = 0;
+
+    close(sock);
+    close(file_fd);
+    return ok && status;
+}
+
+// Sends [offset, offset + length) of the file as one OP_RANGE stream.
+bool upload_range(const sockaddr_in& addr, int file_fd, const string& filename,
+                  uint64_t file_size, uint64_t transfer_id,
+                  uint64_t offset, uint64_t length) {
+    int sock = connect_to(addr);
+    if (sock < 0)
+        return false;
+
+    Xxh64 hash;
+    bool ok = send_u32(sock, OP_RANGE) &&
+              send_u64(sock, transfer_id) &&
+              send_u32(sock, filename.size()) &&
+              send_all(sock, filename.data(), filename.size()) &&
+              send_u64(sock, file_size) &&
+              send_u64(sock, offset) &&
+              send_u64(sock, length) &&
+              send_file_hashed(sock, file_fd, offset, length, hash) &&
+              send_u64(sock, hash.digest());
+
+    uint8_t status = 0;
+    if (ok && !recv_all(sock, &status, sizeof(status)))
+        status = 0;
+
+    close(sock);
+    return ok && status;
+}
+
+// Splits the file into `streams` contiguous ranges and uploads them in parallel.
+bool upload_parallel(const sockaddr_in& addr, const fs::path& file_path,
+                     const string& filename, uint64_t file_size, int streams) {
+    int file_fd = open(file_path.c_str(), O_RDONLY);
+    if (file_fd < 0) {
+        perror("open");
+        return false;
+    }
+
+    random_device rd;
+    uint64_t transfer_id = ((uint64_t)rd() << 32) | rd();
+
+    uint64_t range_len = (file_size + streams - 1) / streams;
+    atomic<bool> all_ok{true};
+    vector<thread> workers;
+    for (uint64_t offset = 0; offset < file_size; offset += range_len) {
+        uint64_t length = min(range_len, file_size - offset);
+        workers.emplace_back([&, offset, length] {
+            if (!upload_range(addr, file_fd, filename, file_size, transfer_id, offset, length))
+                all_ok = false;
+        });
+    }
+    for (auto& t : workers)
+        t.join();
+
+    close(file_fd);
+    return all_ok;
+}
+
+// One frame of an OP_COMPRESSED body on its way through the pipeline.
+// Whichever of a compressor and the sender claims it first decides how it
+// is sent: a compressor packs it, the sender ships it raw.
+struct FrameJob {
+    enum State { Pending, Packing, Packed, Raw };
+
+    uint64_t seq;
+    vector<char> raw;
+    vector<char> packed;
+    size_t packed_len = 0;  // 0 if compression didn't pay off
+
+    atomic<int> state{Pending};
+    mutex m;
+    condition_variable cv;
+
+    bool claim(State s) {
+        int expected = Pending;
+        return state.compare_exchange_strong(expected, s);
+    }
+};
+
+// Reader -> compressors -> sender, linked by bounded queues. The sender
+// never waits for a chunk no compressor has started yet and sends it raw
+// instead, so on a link faster than compression the pipeline degrades to a
+// plain copy rather than throttling the link. A chunk that doesn't shrink
+// by at least 1/32 also goes raw, and then the next SKIP_AFTER_MISS chunks
+// aren't even tried.
+class FramePipeline {
+public:
+    FramePipeline(int sock, int file_fd, uint64_t file_size, uint8_t codec, int level)
+        : sock_(sock), file_fd_(file_fd), file_size_(file_size),
+          codec_(codec), level_(level),
+          send_q_(PIPELINE_DEPTH), work_q_(PIPELINE_DEPTH * 2) {}
+
+    // Sends the whole file as frames and leaves the XXH64 of it in `hash`.
+    bool run(Xxh64& hash) {
+        thread reader([&] { read_chunks(hash); });
+        vector<thread> packers;
+        if (codec_ != CODEC_NONE) {
+            unsigned n = max(2u, thread::hardware_concurrency()) - 1;
+            for (unsigned i = 0; i < n; ++i)
+                packers.emplace_back([&] { pack_chunks(); });
+        }
+
+        bool ok = send_chunks();
+        send_q_.close();
+        work_q_.close();
+        reader.join();
+        for (auto& t : packers)
+            t.join();
+        return ok && read_ok_;
+    }
+
+    uint64_t wire_bytes() const { return wire_bytes_; }
+
+private:
+    void read_chunks(Xxh64& hash) {
+        uint64_t seq = 0;
+        for (uint64_t pos = 0; pos < file_size_; ++seq) {
+            auto job = make_shared<FrameJob>();
+            job->seq = seq;
+            job->raw.resize(min<uint64_t>(FRAME_CHUNK, file_size_ - pos));
+            ssize_t r = pread(file_fd_, job->raw.data(), job->raw.size(), pos);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                cerr << "Read error at offset " << pos << "\n";
+                read_ok_ = false;
+                break;
+            }
+            job->raw.resize(r);
+            hash.update(job->raw.data(), r);
+            pos += r;
+
+            if (!send_q_.push(job))
+                return;
+            if (codec_ != CODEC_NONE && !work_q_.push(job))
+                return;
+        }
+        send_q_.close();
+    }
+
+    void pack_chunks() {
+        Compressor packer(codec_, level_);
+        shared_ptr<FrameJob> job;
+        while (work_q_.pop(job)) {
+            if (job->seq < skip_until_ || !job->claim(FrameJob::Packing))
+                continue;
+
+            size_t raw_len = job->raw.size();
+            job->packed.resize(raw_len - raw_len / 32);
+            job->packed_len = packer.compress(job->raw.data(), raw_len,
+                                              job->packed.data(), job->packed.size());
+            if (job->packed_len == 0)
+                skip_until_ = job->seq + SKIP_AFTER_MISS;
+
+            lock_guard<mutex> lg(job->m);
+            job->state = FrameJob::Packed;
+            job->cv.notify_one();
+        }
+    }
+
+    bool send_chunks() {
+        shared_ptr<FrameJob> job;
+        while (send_q_.pop(job)) {
+            if (!job->claim(FrameJob::Raw)) {
+                unique_lock<mutex> lk(job->m);
+                job->cv.wait(lk, [&] { return job->state == FrameJob::Packed; });
+            }
+
+            bool packed = job->state == FrameJob::Packed && job->packed_len > 0;
+            const vector<char>& payload = packed ? job->packed : job->raw;
+            size_t len = packed ? job->packed_len : job->raw.size();
+
+            uint32_t header[2] = {htonl(job->raw.size()),
+                                  htonl(len | (packed ? FRAME_COMPRESSED : 0))};
+            if (!send_all(sock_, header, sizeof(header)) || !send_all(sock_, payload.data(), len))
+                return false;
+            wire_bytes_ += sizeof(header) + len;
+        }
+        return true;
+    }
+
+    int sock_;
+    int file_fd_;
+    uint64_t file_size_;
+    uint8_t codec_;
+    int level_;
+
+    BoundedQueue<shared_ptr<FrameJob>> send_q_;
+    BoundedQueue<shared_ptr<FrameJob>> work_q_;
+    atomic<uint64_t> skip_until_{0};
+    atomic<bool> read_ok_{true};
+    uint64_t wire_bytes_ = 0;
+};
+
+bool upload_compressed(const sockaddr_in& addr, const fs::path& file_path,
+                       const string& filename, uint64_t file_size, uint8_t codec, int level) {
+    int file_fd = open(file_path.c_str(), O_RDONLY);
+    if (file_fd < 0) {
+        perror("open");
+        return false;
+    }
+    int sock = connect_to(addr);
+    if (sock < 0) {
+        close(file_fd);
+        return false;
+    }
+
+    uint8_t accepted = CODEC_NONE;
+    bool ok = send_u32(sock, OP_COMPRESSED) &&
+              send_all(sock, &codec, sizeof(codec)) &&
+              send_u32(sock, filename.size()) &&
+              send_all(sock, filename.data(), filename.size()) &&
+              send_u64(sock, file_size) &&
+              recv_all(sock, &accepted, sizeof(accepted));
+    if (ok && accepted != codec)
+        cerr << "Server can't decode " << codec_name(codec) << ", sending uncompressed\n";
+    if (ok && !codec_supported(accepted)) {
+        cerr << "Server chose unknown codec " << (int)accepted << "\n";
+        ok = false;
+    }
+
+    Xxh64 hash;
+    FramePipeline pipeline(sock, file_fd, file_size, accepted, level);
+    ok = ok && pipeline.run(hash) && send_u64(sock, hash.digest());
+
+    uint8_t status = 0;
+    if (ok && !recv_all(sock, &status, sizeof(status)))
+        status = 0;
+
+    if (ok && file_size > 0) {
+        cout << "Sent " << pipeline.wire_bytes() << " bytes on the wire for "
+             << file_size << " (" << codec_name(accepted) << ", ratio "
+             << (double)file_size / pipeline.wire_bytes() << ")\n";
+    }
+
+    close(sock);
+    close(file_fd);
+    return ok && status;
+}
+
+// Sends one OP_BATCH record. Returns false if the stream is broken.
+bool send_batch_record(int sock, int file_fd, const string& name) {
+    struct stat st{};
+    fstat(file_fd, &st);
+    uint64_t file_size = st.st_size;
+
+    Xxh64 hash;
+    bool ok = send_u32(sock, name.size()) &&
+              send_all(sock, name.data(), name.size()) &&
+              send_u64(sock, file_size) &&
+              send_file_hashed(sock, file_fd, 0, file_size, hash) &&
+              send_u64(sock, hash.digest());
+    return ok;
+}
+
+// Uploads every regular file under `dir` over one connection. Records go
+// out back to back; a second thread collects the per-file statuses as they
+// arrive, and at most MAX_UNACKED_FILES records are in flight.
+bool upload_batch(const sockaddr_in& addr, const fs::path& dir) {
+    int sock = connect_to(addr);
+    if (sock < 0)
+        return false;
+
+    BoundedQueue<string> unacked(MAX_UNACKED_FILES);
+    uint64_t failed = 0;
+    thread acks([&] {
+        string name;
+        bool connected = true;
+        while (unacked.pop(name)) {
+            uint8_t status = 0;
+            if (connected && !recv_all(sock, &status, sizeof(status)))
+                connected = false;
+            if (!status) {
+                cerr << "Upload failed: " << name << "\n";
+                failed++;
+            }
+        }
+    });
+
+    fs::path base = dir.filename().empty() ? dir.parent_path().filename() : dir.filename();
+    uint64_t files = 0, failed_local = 0;
+    bool ok = send_u32(sock, OP_BATCH);
+    error_code ec;
+    for (auto it = fs::recursive_directory_iterator(dir, ec);
+         ok && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        if (!it->is_regular_file())
+            continue;
+        string name = (base / it->path().lexically_relative(dir)).string();
+        if (name.size() > MAX_NAME_LEN) {
+            cerr << "Skipping, path too long: " << name << "\n";
+            continue;
+        }
+        int file_fd = open(it->path().c_str(), O_RDONLY);
+        if (file_fd < 0) {
+            perror(it->path().c_str());
+            failed_local++;
+            continue;
+        }
+        ok = unacked.push(name) && send_batch_record(sock, file_fd, name);
+        close(file_fd);
+        files++;
+    }
+    if (ec) {
+        cerr << "Cannot walk " << dir << ": " << ec.message() << "\n";
+        ok = false;
+    }
+    ok = ok && send_u32(sock, 0);
+
+    // a half-sent record leaves the stream unusable; unblock the ack reader
+    if (!ok)
+        shutdown(sock, SHUT_RDWR);
+    unacked.close();
+    acks.join();
+    close(sock);
+
+    failed += failed_local;
+    cout << "Sent " << files << " files, " << failed << " failed\n";
+    return ok && failed == 0;
+}
+
+// Same name, size and mtime means "the same upload" across client runs.
+uint64_t make_upload_id(int file_fd, const string& filename, uint64_t file_size) {
+    struct stat st{};
+    fstat(file_fd, &st);
+    Xxh64 h;
+    h.update(filename.data(), filename.size());
+    h.update(&file_size, sizeof(file_size));
+    h.update(&st.st_mtim, sizeof(st.st_mtim));
+    return h.digest();
+}
+
+bool hash_prefix(int file_fd, uint64_t length, Xxh64& h) {
+    vector<char> buf(HASH_CHUNK);
+    for (uint64_t pos = 0; pos < length;) {
+        ssize_t r = pread(file_fd, buf.data(), min<uint64_t>(buf.size(), length - pos), pos);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        h.update(buf.data(), r);
+        pos += r;
+    }
+    return true;
+}
+
+enum class Attempt { Done, Rejected, Dropped };
+
+Attempt upload_resumable_once(const sockaddr_in& addr, int file_fd, const string& filename,
+                              uint64_t file_size, uint64_t upload_id) {
+    int sock = connect_to(addr);
+    if (sock < 0)
+        return Attempt::Dropped;
+
+    uint64_t committed = 0, prefix_hash = 0;
+    bool ok = send_u32(sock, OP_RESUME) &&
+              send_u64(sock, upload_id) &&
+              send_u32(sock, filename.size()) &&
+              send_all(sock, filename.data(), filename.size()) &&
+              send_u64(sock, file_size) &&
+              recv_u64(sock, committed) &&
+              recv_u64(sock, prefix_hash);
+    if (!ok) {
+        close(sock);
+        return Attempt::Dropped;
+    }
+
+    // the trailing hash covers the whole file, so the prefix hash carries on
+    // over the rest of the body
+    uint64_t start = 0;
+    Xxh64 hash;
+    if (committed > 0 && committed <= file_size &&
+        hash_prefix(file_fd, committed, hash) && hash.digest() == prefix_hash) {
+        start = committed;
+        cout << "Resuming at " << start << " of " << file_size << " bytes\n";
+    } else {
+        hash.reset();
+    }
+
+    ok = send_u64(sock, start) &&
+         send_file_hashed(sock, file_fd, start, file_size - start, hash) &&
+         send_u64(sock, hash.digest());
+
+    uint8_t status = 0;
+    if (ok)
+        ok = recv_all(sock, &status, sizeof(status));
+
+    close(sock);
+    if (!ok)
+        return Attempt::Dropped;
+    return status ? Attempt::Done : Attempt::Rejected;
+}
+
+// Retries dropped connections with growing pauses; each retry continues from
+// the offset the server has committed.
+bool upload_resumable(const sockaddr_in& addr, const fs::path& file_path,
+                      const string& filename, uint64_t file_size) {
+    int file_fd = open(file_path.c_str(), O_RDONLY);
+    if (file_fd < 0) {
+        perror("open");
+        return false;
+    }
+    uint64_t upload_id = make_upload_id(file_fd, filename, file_size);
+
+    Attempt result = Attempt::Dropped;
+    for (int attempt = 0; attempt < MAX_RESUME_ATTEMPTS; ++attempt) {
+        if (attempt > 0) {
+            cerr << "Connection lost, retrying (" << attempt << "/"
+                 << MAX_RESUME_ATTEMPTS - 1 << ")\n";
+            this_thread::sleep_for(chrono::seconds(min(attempt, 10)));
+        }
+        result = upload_resumable_once(addr, file_fd, filename, file_size, upload_id);
+        if (result != Attempt::Dropped)
+            break;
+    }
+
+    close(file_fd);
+    return result == Attempt::Done;
+}
+
+struct ChunkRef {
+    uint64_t offset;
+    uint32_t len;
+    ChunkId id;
+};
+
+// Chunks the file and lists the chunks, then sends only those the server
+// asks for, straight from the page cache. Chunking reads the file once up
+// front; if it changes before its chunks go out, the server rejects them.
+bool upload_dedup(const sockaddr_in& addr, const fs::path& file_path,
+                  const string& filename, uint64_t file_size) {
+    int file_fd = open(file_path.c_str(), O_RDONLY);
+    if (file_fd < 0) {
+        perror("open");
+        return false;
+    }
+
+    vector<ChunkRef> chunks;
+    string list;
+    Xxh64 hash;
+    Chunker chunker(file_fd);
+    const char* data;
+    size_t len;
+    uint64_t offset = 0;
+    while (chunker.next(data, len)) {
+        ChunkRef c{offset, (uint32_t)len, chunk_id(data, len)};
+        hash.update(data, len);
+        chunks.push_back(c);
+        uint32_t be_len = htonl(c.len);
+        uint64_t be_lo = htonll(c.id.lo), be_hi = htonll(c.id.hi);
+        list.append((const char*)&be_len, sizeof(be_len));
+        list.append((const char*)&be_lo, sizeof(be_lo));
+        list.append((const char*)&be_hi, sizeof(be_hi));
+        offset += len;
+    }
+    if (chunker.failed() || offset != file_size || chunks.size() > MAX_DEDUP_CHUNKS) {
+        cerr << (chunks.size() > MAX_DEDUP_CHUNKS ? "File has too many chunks for dedup\n"
+                                                  : "Read error while chunking\n");
+        close(file_fd);
+        return false;
+    }
+
+    int sock = connect_to(addr);
+    if (sock < 0) {
+        close(file_fd);
+        return false;
+    }
+
+    string bitmap((chunks.size() + 7) / 8, '\0');
+    bool ok = send_u32(sock, OP_DEDUP) &&
+              send_u32(sock, filename.size()) &&
+              send_all(sock, filename.data(), filename.size()) &&
+              send_u64(sock, file_size) &&
+              send_u32(sock, chunks.size()) &&
+              send_all(sock, list.data(), list.size()) &&
+              recv_all(sock, bitmap.data(), bitmap.size());
+
+    SocketTuner tuner(sock, true);
+    uint64_t sent = 0, sent_chunks = 0;
+    for (size_t i = 0; ok && i < chunks.size(); i++) {
+        if (!(bitmap[i / 8] & (1 << (i % 8))))
+            continue;
+        ok = send_file_range(sock, file_fd, chunks[i].offset, chunks[i].len);
+        tuner.add(chunks[i].len);
+        sent += chunks[i].len;
+        sent_chunks++;
+    }
+    ok = ok && send_u64(sock, hash.digest());
+
+    uint8_t status = 0;
+    if (ok && !recv_all(sock, &status, sizeof(status)))
+        status = 0;
+
+    if (ok) {
+        cout << "Sent " << sent_chunks << " of " << chunks.size() << " chunks, "
+             << sent << " of " << file_size << " bytes\n";
+    }
+
+    close(sock);
+    close(file_fd);
+    return ok && status;
+}
+
+// Sends an OP_GET for [offset, offset + length) and reads the reply header.
+// Returns the socket, positioned at the first body byte, or -1 if the
+// connection failed or the server refused.
+int request_range(const sockaddr_in& addr, const string& name, uint64_t offset,
+                  uint64_t length, uint64_t& file_size, uint64_t& served) {
+    int sock = connect_to(addr);
+    if (sock < 0)
+        return -1;
+
+    uint8_t status = 0;
+    bool ok = send_u32(sock, OP_GET) &&
+              send_u32(sock, name.size()) &&
+              send_all(sock, name.data(), name.size()) &&
+              send_u64(sock, offset) &&
+              send_u64(sock, length) &&
+              recv_all(sock, &status, sizeof(status)) &&
+              recv_u64(sock, file_size) &&
+              recv_u64(sock, served);
+    if (!ok || !status) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Stores `length` body bytes from the socket at `out_offset` of the file.
+bool receive_range(int sock, int out_fd, uint64_t out_offset, uint64_t length) {
+    SocketTuner tuner(sock, false);
+    vector<char> buf(HASH_CHUNK);
+    while (length > 0) {
+        if (buf.size() < tuner.chunk())
+            buf.resize(tuner.chunk());
+        ssize_t r = recv(sock, buf.data(), min<uint64_t>(buf.size(), length), 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            cerr << "Connection lost with " << length << " bytes to go\n";
+            return false;
+        }
+        for (ssize_t done = 0; done < r;) {
+            ssize_t n = pwrite(out_fd, buf.data() + done, r - done, out_offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                perror("pwrite");
+                return false;
+            }
+            done += n;
+        }
+        tuner.add(r);
+        out_offset += r;
+        length -= r;
+    }
+    return true;
+}
+
+// Fetches [offset, offset + length) of a stored file into out_path. With
+// several streams a first request learns the file size, then each stream
+// asks for one contiguous slice and writes it at its place in the output.
+bool download(const sockaddr_in& addr, const string& name, uint64_t offset,
+              uint64_t length, int streams, const fs::path& out_path) {
+    uint64_t file_size, served;
+    int sock = request_range(addr, name, offset, streams > 1 ? 0 : length, file_size, served);
+    if (sock < 0) {
+        cerr << "Server has no " << name << " or no byte " << offset << " in it\n";
+        return false;
+    }
+    int out_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd < 0) {
+        perror("open");
+        close(sock);
+        return false;
+    }
+
+    bool ok;
+    if (streams == 1) {
+        ok = receive_range(sock, out_fd, 0, served);
+        close(sock);
+    } else {
+        close(sock);
+        uint64_t total = min(length, file_size - offset);
+        uint64_t slice_len = (total + streams - 1) / streams;
+        atomic<bool> all_ok{ftruncate(out_fd, total) == 0};
+        vector<thread> workers;
+        for (uint64_t pos = 0; pos < total; pos += slice_len) {
+            uint64_t len = min(slice_len, total - pos);
+            workers.emplace_back([&, pos, len] {
+                uint64_t size, got;
+                int s = request_range(addr, name, offset + pos, len, size, got);
+                // the file changing between requests would mix two versions
+                if (s < 0 || size != file_size || got != len || !receive_range(s, out_fd, pos, len))
+                    all_ok = false;
+                if (s >= 0)
+                    close(s);
+            });
+        }
+        for (auto& t : workers)
+            t.join();
+        ok = all_ok;
+    }
+
+    close(out_fd);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    // a peer that drops the connection must fail the upload, not kill us in sendfile()
+    signal(SIGPIPE, SIG_IGN);
+
+    int streams = 1;
+    bool resumable = false;
+    bool dedup = false;
+    uint8_t codec = CODEC_NONE;
+    int level = 0;
+    bool get = false;
+    uint64_t get_offset = 0, get_length = UINT64_MAX;
+    fs::path get_out;
+    bool bad_args = false;
+    int opt;
+    const char* tls_pem = nullptr;
+    while ((opt = getopt(argc, argv, "b:C:dgNo:rs:t:z:")) != -1) {
+        if (opt == 'b') {
+            char* end;
+            get_offset = strtoull(optarg, &end, 10);
+            if (*end == ':')
+                get_length = strtoull(end + 1, &end, 10);
+            bad_args |= *end != '\0';
+        } else if (opt == 'C')
+            congestion = optarg;
+        else if (opt == 'd')
+            dedup = true;
+        else if (opt == 'g')
+            get = true;
+        else if (opt == 'N')
+            socket_tuning = false;
+        else if (opt == 'o')
+            get_out = optarg;
+        else if (opt == 's')
+            streams = atoi(optarg);
+        else if (opt == 'r')
+            resumable = true;
+        else if (opt == 't')
+            tls_pem = optarg;
+        else if (opt == 'z')
+            bad_args |= !parse_codec(optarg, codec, level);
+        else
+            bad_args = true;
+    }
+
+    int modes = (streams > 1) + resumable + (codec != CODEC_NONE) + dedup;
+    bool get_only = get_offset != 0 || get_length != UINT64_MAX || !get_out.empty();
+    if (bad_args || argc - optind != 3 || streams < 1 || modes > 1 ||
+        (get && (resumable || codec != CODEC_NONE || dedup)) || (!get && get_only)) {
+        cerr << "Usage: client [-t pem] [-C algo] [-N] [-s streams | -r | -z codec[:level] | -d]\n"
+             << "              <file_path> <host> <port>\n"
+             << "       client [-t pem] [-C algo] [-N] -g [-s streams] [-b offset[:length]] [-o out_path]\n"
+             << "              <name> <host> <port>\n"
+             << "  a directory as <file_path> uploads all files under it over one connection\n"
+             << "  -s N  upload or download over N parallel connections\n"
+             << "  -r    resumable upload, reconnects and continues after a drop\n"
+             << "  -z    compress on the wire with deflate or zstd, e.g. -z zstd:3\n"
+             << "  -d    send only the chunks of the file the server doesn't have yet\n"
+             << "  -g    download <name> from the server's uploads/\n"
+             << "  -b    download only `length` bytes (default: the rest) from `offset`\n"
+             << "  -o    where to store the download (default: the name's last component)\n"
+             << "  -t    talk TLS, trusting the certificates in this PEM file; the server's\n"
+             << "        certificate must name <host>\n"
+             << "  -C    TCP congestion control to use, e.g. bbr\n"
+             << "  -N    don't size socket buffers and chunks from the measured bandwidth-delay\n"
+             << "        product; keep the kernel's autotuning and fixed chunks\n";
         return 1;
     }
 
+    fs::path file_path = argv[optind];
+    string host = argv[optind + 1];
+    int port = stoi(argv[optind + 2]);
+
     hostent* server = gethostbyname(host.c_str());
     if (!server) {
         cerr << "Host not found\n";
@@ -53,35 +883,55 @@ int main(int argc, char* argv[]) {
     addr.sin_port = htons(port);
     memcpy(&addr.sin_addr.s_addr, server->h_addr, server->h_length);
 
-    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("connect");
-        return 1;
+    if (tls_pem) {
+        string error;
+        tls_ctx = tls_context(false, tls_pem, error);
+        if (!tls_ctx) {
+            cerr << "TLS: " << error << "\n";
+            return 1;
+        }
+        tls_host = host;
     }
 
-    uint32_t name_len = htonl(filename.size());
-    uint64_t size_net = htonll(file_size);
-
-    send(sock, &name_len, sizeof(name_len), 0);
-    send(sock, filename.data(), filename.size(), 0);
-    send(sock, &size_net, sizeof(size_net), 0);
+    if (get) {
+        if (get_out.empty())
+            get_out = file_path.filename();
+        bool ok = download(addr, file_path.string(), get_offset, get_length, streams, get_out);
+        cout << (ok ? "File transfer successful\n" : "File transfer failed\n");
+        return ok ? 0 : 1;
+    }
 
-    ifstream in(file_path, ios::binary);
-    vector<char> buf(64 * 1024);
+    if (!fs::exists(file_path)) {
+        cerr << "File does not exist\n";
+        return 1;
+    }
 
-    while (in) {
-        in.read(buf.data(), buf.size());
-        streamsize r = in.gcount();
-        if (r > 0)
-            send(sock, buf.data(), r, 0);
+    bool batch = fs::is_directory(file_path);
+    if (batch && modes > 0) {
+        cerr << "Directories are uploaded as one batch; -s, -r, -z and -d don't apply\n";
+        return 1;
     }
+    uint64_t file_size = batch ? 0 : fs::file_size(file_path);
+    string filename = file_path.filename().string();
 
-    uint8_t status;
-    recv(sock, &status, sizeof(status), MSG_WAITALL);
+    bool ok;
+    if (batch)
+        ok = upload_batch(addr, file_path);
+    else if (resumable)
+        ok = upload_resumable(addr, file_path, filename, file_size);
+    else if (codec != CODEC_NONE)
+        ok = upload_compressed(addr, file_path, filename, file_size, codec, level);
+    else if (dedup)
+        ok = upload_dedup(addr, file_path, filename, file_size);
+    else if (streams > 1 && file_size >= (uint64_t)streams)
+        ok = upload_parallel(addr, file_path, filename, file_size, streams);
+    else
+        ok = upload_whole(addr, file_path, filename, file_size);
 
-    if (status)
+    if (ok)
         cout << "File transfer successful\n";
     else
         cout << "File transfer failed\n";
 
-    close(sock);
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define LAB2_HAVE_ZSTD 1
+#endif
+
+// Per-chunk compression for OP_COMPRESSED bodies. Every chunk is compressed
+// on its own, so chunks can be (de)compressed in parallel and a chunk that
+// doesn't shrink can go out raw. Link with -lz, plus -lzstd when zstd.h is
+// available.
+
+enum Codec : uint8_t {
+    CODEC_NONE = 0,
+    CODEC_DEFLATE = 1,
+    CODEC_ZSTD = 2,
+};
+
+inline bool codec_supported(uint8_t codec) {
+#ifdef LAB2_HAVE_ZSTD
+    if (codec == CODEC_ZSTD)
+        return true;
+#endif
+    return codec == CODEC_NONE || codec == CODEC_DEFLATE;
+}
+
+inline const char* codec_name(uint8_t codec) {
+    switch (codec) {
+    case CODEC_DEFLATE:
+        return "deflate";
+    case CODEC_ZSTD:
+        return "zstd";
+    default:
+        return "none";
+    }
+}
+
+// Parses "deflate", "zstd:3" and the like. Returns false on an unknown
+// name or a codec this build can't use.
+inline bool parse_codec(const std::string& spec, uint8_t& codec, int& level) {
+    std::string name = spec.substr(0, spec.find(':'));
+    if (name == "deflate") {
+        codec = CODEC_DEFLATE;
+        level = 1;
+    } else if (name == "zstd") {
+        codec = CODEC_ZSTD;
+        level = 3;
+    } else {
+        return false;
+    }
+    if (name.size() < spec.size())
+        level = atoi(spec.c_str() + name.size() + 1);
+    return codec_supported(codec);
+}
+
+// Keeps its codec context between chunks; one instance per thread.
+class Compressor {
+public:
+    Compressor(uint8_t codec, int level) : codec_(codec) {
+        if (codec_ == CODEC_DEFLATE) {
+            memset(&z_, 0, sizeof(z_));
+            if (deflateInit(&z_, level) != Z_OK)
+                throw std::runtime_error("deflateInit failed");
+        }
+#ifdef LAB2_HAVE_ZSTD
+        if (codec_ == CODEC_ZSTD) {
+            zc_ = ZSTD_createCCtx();
+            if (!zc_ || ZSTD_isError(ZSTD_CCtx_setParameter(zc_, ZSTD_c_compressionLevel, level)))
+                throw std::runtime_error("ZSTD_createCCtx failed");
+        }
+#endif
+    }
+
+    ~Compressor() {
+        if (codec_ == CODEC_DEFLATE)
+            deflateEnd(&z_);
+#ifdef LAB2_HAVE_ZSTD
+        if (zc_)
+            ZSTD_freeCCtx(zc_);
+#endif
+    }
+
+    Compressor(const Compressor&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+
+    // Compresses src into dst. Returns the compressed size, or 0 if the
+    // result would not fit into `cap` bytes.
+    size_t compress(const char* src, size_t len, char* dst, size_t cap) {
+        if (codec_ == CODEC_DEFLATE) {
+            deflateReset(&z_);
+            z_.next_in = (Bytef*)src;
+            z_.avail_in = len;
+            z_.next_out = (Bytef*)dst;
+            z_.avail_out = cap;
+            if (deflate(&z_, Z_FINISH) != Z_STREAM_END)
+                return 0;
+            return cap - z_.avail_out;
+        }
+#ifdef LAB2_HAVE_ZSTD
+        if (codec_ == CODEC_ZSTD) {
+            size_t n = ZSTD_compress2(zc_, dst, cap, src, len);
+            return ZSTD_isError(n) ? 0 : n;
+        }
+#endif
+        return 0;
+    }
+
+private:
+    uint8_t codec_;
+    z_stream z_;
+#ifdef LAB2_HAVE_ZSTD
+    ZSTD_CCtx* zc_ = nullptr;
+#endif
+};
+
+class Decompressor {
+public:
+    explicit Decompressor(uint8_t codec) : codec_(codec) {
+        if (codec_ == CODEC_DEFLATE) {
+            memset(&z_, 0, sizeof(z_));
+            if (inflateInit(&z_) != Z_OK)
+                throw std::runtime_error("inflateInit failed");
+        }
+#ifdef LAB2_HAVE_ZSTD
+        if (codec_ == CODEC_ZSTD && !(zd_ = ZSTD_createDCtx()))
+            throw std::runtime_error("ZSTD_createDCtx failed");
+#endif
+    }
+
+    ~Decompressor() {
+        if (codec_ == CODEC_DEFLATE)
+            inflateEnd(&z_);
+#ifdef LAB2_HAVE_ZSTD
+        if (zd_)
+            ZSTD_freeDCtx(zd_);
+#endif
+    }
+
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    // Returns false unless src decodes to exactly raw_len bytes.
+    bool decompress(const char* src, size_t len, char* dst, size_t raw_len) {
+        if (codec_ == CODEC_DEFLATE) {
+            inflateReset(&z_);
+            z_.next_in = (Bytef*)src;
+            z_.avail_in = len;
+            z_.next_out = (Bytef*)dst;
+            z_.avail_out = raw_len;
+            return inflate(&z_, Z_FINISH) == Z_STREAM_END && z_.avail_out == 0;
+        }
+#ifdef LAB2_HAVE_ZSTD
+        if (codec_ == CODEC_ZSTD)
+            return ZSTD_decompressDCtx(zd_, dst, raw_len, src, len) == raw_len;
+#endif
+        return false;
+    }
+
+private:
+    uint8_t codec_;
+    z_stream z_;
+#ifdef LAB2_HAVE_ZSTD
+    ZSTD_DCtx* zd_ = nullptr;
+#endif
+};
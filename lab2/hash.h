@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Streaming XXH64. The whole state is a trivially copyable struct, so it can
+// be checkpointed to disk and restored to continue hashing later.
+// Assumes a little-endian host.
+struct Xxh64 {
+    static constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t P3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+    uint64_t total_len = 0;
+    uint64_t v[4];
+    uint8_t mem[32];
+    uint32_t mem_size = 0;
+    uint64_t seed = 0;
+
+    Xxh64() { reset(0); }
+    explicit Xxh64(uint64_t seed) { reset(seed); }
+
+    void reset(uint64_t s = 0) {
+        seed = s;
+        total_len = 0;
+        mem_size = 0;
+        v[0] = s + P1 + P2;
+        v[1] = s + P2;
+        v[2] = s;
+        v[3] = s - P1;
+    }
+
+    void update(const void* data, size_t len) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        const uint8_t* end = p + len;
+        total_len += len;
+
+        if (mem_size + len < 32) {
+            memcpy(mem + mem_size, p, len);
+            mem_size += len;
+            return;
+        }
+        if (mem_size) {
+            size_t fill = 32 - mem_size;
+            memcpy(mem + mem_size, p, fill);
+            consume(mem);
+            p += fill;
+            mem_size = 0;
+        }
+        while (p + 32 <= end) {
+            consume(p);
+            p += 32;
+        }
+        if (p < end) {
+            mem_size = end - p;
+            memcpy(mem, p, mem_size);
+        }
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (total_len >= 32) {
+            h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+            for (uint64_t lane : v)
+                h = (h ^ round(0, lane)) * P1 + P4;
+        } else {
+            h = seed + P5;
+        }
+        h += total_len;
+
+        const uint8_t* p = mem;
+        const uint8_t* end = mem + mem_size;
+        for (; p + 8 <= end; p += 8)
+            h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+        if (p + 4 <= end) {
+            h = rotl(h ^ (uint64_t)read32(p) * P1, 23) * P2 + P3;
+            p += 4;
+        }
+        for (; p < end; ++p)
+            h = rotl(h ^ *p * P5, 11) * P1;
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    static uint64_t hash(const void* data, size_t len, uint64_t seed = 0) {
+        Xxh64 st(seed);
+        st.update(data, len);
+        return st.digest();
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    static uint64_t round(uint64_t acc, uint64_t input) {
+        return rotl(acc + input * P2, 31) * P1;
+    }
+
+    static uint64_t read64(const uint8_t* p) {
+        uint64_t x;
+        memcpy(&x, p, sizeof(x));
+        return x;
+    }
+
+    static uint32_t read32(const uint8_t* p) {
+        uint32_t x;
+        memcpy(&x, p, sizeof(x));
+        return x;
+    }
+
+    void consume(const uint8_t* p) {
+        v[0] = round(v[0], read64(p));
+        v[1] = round(v[1], read64(p + 8));
+        v[2] = round(v[2], read64(p + 16));
+        v[3] = round(v[3], read64(p + 24));
+    }
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Wire format shared by client.cpp and server.cpp.
+// With -t on both ends the same bytes travel inside TLS 1.2, see tls.h.
+//
+// Legacy upload (one file per connection, unverified):
+//   u32 name_len, name, u64 file_size, body        -> u8 status
+//
+// Every newer request starts with a u32 opcode word instead. Opcodes carry
+// OP_MAGIC in the upper half, so they can never be mistaken for a legal
+// name_len (1..MAX_NAME_LEN). Their bodies are followed by a u64 XXH64
+// trailer that the server checks against the bytes it stored before
+// answering.
+//
+// OP_UPLOAD (one file per connection):
+//   u32 name_len, name, u64 file_size, body, u64 hash  -> u8 status
+//
+// OP_RANGE (one byte range of a multi-stream upload):
+//   u64 transfer_id, u32 name_len, name, u64 file_size,
+//   u64 offset, u64 length, body, u64 hash         -> u8 status
+// The hash covers this range only. The status is sent only after every
+// range of the transfer has landed. Ranges may not overlap or repeat; one
+// that does fails the whole transfer.
+//
+// OP_RESUME (resumable upload):
+//   u64 upload_id, u32 name_len, name, u64 file_size
+//                        <- u64 committed, u64 prefix_hash
+//   u64 start, body[start, file_size), u64 hash    -> u8 status
+// prefix_hash is XXH64 of the first `committed` bytes the server holds for
+// this upload_id. The client answers start = committed if its own prefix
+// hashes the same, or start = 0 to restart from scratch. The trailing hash
+// covers the whole file.
+//
+// OP_COMPRESSED (one file per connection, compressed on the wire):
+//   u8 codec, u32 name_len, name, u64 file_size    <- u8 codec
+//   frames, u64 hash                               -> u8 status
+// The client proposes a codec (codec.h); the server answers with the one it
+// will decode, CODEC_NONE if it doesn't support the proposal. The body is a
+// sequence of frames, each u32 raw_len, u32 packed_len, payload, carrying
+// raw_len bytes of the file. The payload is compressed when packed_len has
+// FRAME_COMPRESSED set and is the raw bytes otherwise. The hash covers the
+// uncompressed file.
+//
+// OP_BATCH (many files over one connection):
+//   records, u32 0
+//   record: u32 name_len, name, u64 file_size, body, u64 hash  -> u8 status
+// name is a relative path, created under uploads/ with its directories.
+// Statuses come back in record order while later records are still being
+// sent, so the client has to read them concurrently.
+//
+// OP_GET (download a stored file or a byte range of it):
+//   u32 name_len, name, u64 offset, u64 length
+//                  <- u8 status, u64 file_size, u64 served, body
+// name is a relative path under uploads/, as in OP_BATCH. The range is
+// clamped to the end of the file: length UINT64_MAX reads to the end and
+// length 0 only asks for file_size. A missing file or an offset past the
+// end gives status 0 with file_size = served = 0. The body is the served
+// bytes, sent straight from the page cache, with no trailer; the connection
+// closes after it.
+//
+// OP_DEDUP (one file per connection, sending only chunks the server lacks):
+//   u32 name_len, name, u64 file_size, u32 chunk_count,
+//   chunk_count x (u32 len, u64 id_lo, u64 id_hi) <- missing bitmap
+//   missing chunks, u64 hash                       -> u8 status
+// The client cuts the file into content-defined chunks and names each by
+// its 128-bit id (chunker.h). The bitmap has (chunk_count + 7) / 8 bytes,
+// one bit per chunk, least significant bit first; a set bit asks for that
+// chunk. The client then sends just those chunks, in order, as raw bytes.
+// The server checks each one against its id before it enters the chunk
+// store, builds the file from stored and received chunks, and checks the
+// hash of the whole file as usual.
+
+constexpr uint32_t MAX_NAME_LEN = 4096;
+
+constexpr uint32_t OP_MAGIC = 0x4C320000;  // "L2"
+constexpr uint32_t OP_RANGE = OP_MAGIC | 0x01;
+constexpr uint32_t OP_RESUME = OP_MAGIC | 0x02;
+constexpr uint32_t OP_UPLOAD = OP_MAGIC | 0x03;
+constexpr uint32_t OP_COMPRESSED = OP_MAGIC | 0x04;
+constexpr uint32_t OP_BATCH = OP_MAGIC | 0x05;
+constexpr uint32_t OP_GET = OP_MAGIC | 0x06;
+constexpr uint32_t OP_DEDUP = OP_MAGIC | 0x07;
+
+constexpr uint32_t FRAME_COMPRESSED = 0x80000000;
+constexpr uint32_t MAX_FRAME_SIZE = 4 * 1024 * 1024;
+
+constexpr uint32_t MAX_DEDUP_CHUNKS = 1 << 20;
+constexpr uint32_t MAX_DEDUP_CHUNK_SIZE = 1024 * 1024;
+constexpr size_t DEDUP_ENTRY_SIZE = 20;  // u32 len, u64 id_lo, u64 id_hi
+
+inline bool is_opcode(uint32_t word) { return (word & 0xFFFF0000) == OP_MAGIC; }
+
+inline uint64_t htonll(uint64_t x) {
+    if (htonl(1) != 1)
+        return ((uint64_t)htonl(x & 0xFFFFFFFF) << 32) | htonl(x >> 32);
+    return x;
+}
+
+inline uint64_t ntohll(uint64_t x) { return htonll(x); }
+
+// Blocking helpers: loop over short reads/writes, false on error or EOF.
+inline bool send_all(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+inline bool recv_all(int fd, void* data, size_t len) {
+    char* p = static_cast<char*>(data);
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, MSG_WAITALL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+inline bool send_u32(int fd, uint32_t v) {
+    v = htonl(v);
+    return send_all(fd, &v, sizeof(v));
+}
+
+inline bool send_u64(int fd, uint64_t v) {
+    v = htonll(v);
+    return send_all(fd, &v, sizeof(v));
+}
+
+inline bool recv_u32(int fd, uint32_t& v) {
+    if (!recv_all(fd, &v, sizeof(v)))
+        return false;
+    v = ntohl(v);
+    return true;
+}
+
+inline bool recv_u64(int fd, uint64_t& v) {
+    if (!recv_all(fd, &v, sizeof(v)))
+        return false;
+    v = ntohll(v);
+    return true;
+}
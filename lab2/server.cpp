@@ -1,121 +1,2358 @@
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include <atomic>
 #include <chrono>
+#include <climits>
+#include <csignal>
+#include <deque>
 #include <filesystem>
-#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "bounded_queue.h"
+#include "chunker.h"
+#include "codec.h"
+#include "hash.h"
+#include "protocol.h"
+#include "socket_tuner.h"
+#include "stats.h"
+#include "tls.h"
+#include "token_bucket.h"
+
 using namespace std;
 namespace fs = std::filesystem;
 
 constexpr size_t BUF_SIZE = 64 * 1024;
+constexpr size_t SPLICE_PIPE_SIZE = 1024 * 1024;
+constexpr uint64_t BODY_BUDGET = 4 * 1024 * 1024;
+constexpr int MAX_EVENTS = 8;
+constexpr auto RANGE_WAIT_TIMEOUT = chrono::seconds(60);
+constexpr auto IDLE_TIMEOUT = chrono::seconds(60);
+constexpr uint64_t JOURNAL_INTERVAL = 64 * 1024 * 1024;
+constexpr uint32_t JOURNAL_MAGIC = 0x4C324A31;  // "L2J1"
+constexpr size_t WRITE_BUFFER = 1024 * 1024;
+constexpr size_t WRITE_POOL_BUFFERS = 64;
+constexpr int DISK_WRITERS = 2;
+constexpr size_t DIRECT_ALIGN = 4096;
+const fs::path CHUNK_STORE = "chunks";  // OP_DEDUP chunks, beside uploads/
+const string TEMP_SUFFIX = ".l2tmp";      // bodies still in flight
+constexpr int MAX_VERSIONS = 1000;
+constexpr double LIMIT_BURST_SECONDS = 0.1;  // allowance a rate limit lets pile up
+
+bool use_splice = true;
+size_t max_transfers = 1024;
+bool use_direct = false;
+bool sync_at_end = false;     // fdatasync before acknowledging a body
+uint64_t sync_interval = 0;   // and every this many bytes, if nonzero
+double client_rate = 0;       // -l: body bytes/s per client address, 0 = unlimited
+double total_rate = 0;        // -L: body bytes/s over all uploads
+bool fair_share = false;      // -F: split total_rate evenly over the open bodies
+
+// -p: what publishing an upload does to an existing file of the same name
+enum class Conflict { Replace, Keep, Version };
+Conflict on_conflict = Conflict::Replace;
+
+SSL_CTX* tls_ctx = nullptr;  // -t: connections start with a TLS handshake
+const char* congestion = nullptr;  // -C: congestion control for accepted sockets
+
+int epoll_fd = -1;
+int listen_fd = -1;
+int tick_fd = -1;
+int json_fd = -1;  // -j: JSON lines telemetry feed
+int throttle_fd = -1;
+
+// epoll tags for the non-session descriptors
+char LISTEN_TAG, TICK_TAG, THROTTLE_TAG;
+
+struct ScopedFd {
+    int fd;
+    explicit ScopedFd(int fd) : fd(fd) {}
+    ~ScopedFd() {
+        if (fd != -1)
+            close(fd);
+    }
+    ScopedFd(const ScopedFd&) = delete;
+    ScopedFd& operator=(const ScopedFd&) = delete;
+};
 
-uint64_t ntohll(uint64_t x) {
-    if (htonl(1) != 1)
-        return ((uint64_t)ntohl(x & 0xFFFFFFFF) << 32) | ntohl(x >> 32);
-    return x;
+bool write_at(int fd, const char* data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
 }
 
-void handle_client(int client_fd, sockaddr_in client_addr) {
-    try {
-        uint32_t name_len_net;
-        recv(client_fd, &name_len_net, sizeof(name_len_net), MSG_WAITALL);
-        uint32_t name_len = ntohl(name_len_net);
+// ---------- atomic publishing ----------
 
-        if (name_len == 0 || name_len > 4096)
-            throw runtime_error("Invalid filename length");
+// Bodies land in a hidden temp file beside their final name and only take
+// that name once complete, so nobody ever sees a truncated or half-written
+// upload under it, and two uploads of one name never write the same file.
+
+atomic<uint64_t> temp_seq{0};
+
+// Creates .<name>.<pid>.<n>.l2tmp next to `path`; -1 if it can't. It is
+// opened for reading too, so that spliced bodies can be hashed.
+int open_temp(const fs::path& path, fs::path& tmp) {
+    for (;;) {
+        tmp = path.parent_path() / ("." + path.filename().string() + "." + to_string(getpid()) +
+                                    "." + to_string(temp_seq++) + TEMP_SUFFIX);
+        int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0 || errno != EEXIST)
+            return fd;
+    }
+}
+
+// rename() with renameat2() flags. Filesystems that can't do
+// RENAME_NOREPLACE get link() + unlink(), which refuses to replace too.
+int rename_file(const fs::path& from, const fs::path& to, unsigned flags) {
+    if (renameat2(AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(), flags) == 0)
+        return 0;
+    if (flags == 0 || (errno != EINVAL && errno != ENOSYS))
+        return -1;
+    if (link(from.c_str(), to.c_str()) < 0)
+        return -1;
+    unlink(from.c_str());
+    return 0;
+}
+
+void sync_dir(const fs::path& dir) {
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool ok = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+    if (!ok)
+        throw runtime_error("Cannot sync directory");
+}
+
+// Gives a finished temp file its name in one step: readers see the old file
+// or the new one, never a mix. With -p version an existing name makes it
+// name.~N~ instead; with -p keep the upload is dropped. Returns the name
+// used, or an empty path if it was dropped. The directory entry is synced
+// whenever the fsync policy syncs file data.
+fs::path publish(const fs::path& tmp, const fs::path& path) {
+    fs::path target = path;
+    unsigned flags = on_conflict == Conflict::Replace ? 0 : RENAME_NOREPLACE;
+    for (int version = 1; rename_file(tmp, target, flags) < 0; version++) {
+        if (errno != EEXIST || version > MAX_VERSIONS)
+            throw runtime_error("Cannot publish uploaded file");
+        if (on_conflict == Conflict::Keep) {
+            unlink(tmp.c_str());
+            return {};
+        }
+        target = path;
+        target += ".~" + to_string(version) + "~";
+    }
+    if (sync_at_end)
+        sync_dir(target.parent_path());
+    return target;
+}
 
-        string filename(name_len, '\0');
-        recv(client_fd, filename.data(), name_len, MSG_WAITALL);
+// Leftovers of bodies that were in flight when the server last stopped.
+void remove_stale_temps(const fs::path& dir) {
+    error_code ec;
+    for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        const fs::path& p = it->path();
+        if (p.extension() == TEMP_SUFFIX && it->is_regular_file(ec))
+            fs::remove(p, ec);
+    }
+}
 
-        uint64_t file_size_net;
-        recv(client_fd, &file_size_net, sizeof(file_size_net), MSG_WAITALL);
-        uint64_t file_size = ntohll(file_size_net);
+// Stores the body of a request into the output file.
+class Receiver {
+public:
+    // sees every stored chunk of file data, in order
+    using Observer = function<void(const char*, size_t)>;
 
-        fs::create_directories("uploads");
+    virtual ~Receiver() = default;
 
-        fs::path safe_name = fs::path(filename).filename();
-        fs::path out_path = fs::path("uploads") / safe_name;
+    // Stores up to `max` bytes of file data at `offset`. Returns the number
+    // of bytes stored, 0 on EOF, -1 on error (EAGAIN if the socket has
+    // nothing yet), or PARKED if the session was parked until it can go on.
+    virtual ssize_t receive(int sock, int out_fd, uint64_t offset, uint64_t max) = 0;
 
-        ofstream out(out_path, ios::binary);
-        if (!out)
-            throw runtime_error("Cannot open output file");
+    static constexpr ssize_t PARKED = -2;
+
+    Clock::duration disk_time{};  // spent inside writes to the output file
+    size_t chunk = BUF_SIZE;      // most bytes to take per read, grown with the path's BDP
+};
+
+// Moves body bytes from a socket into a file at explicit offsets. In splice
+// mode the data goes socket -> pipe -> file without entering user space; if
+// the socket or the filesystem refuses splice() it switches to recv()+pwrite().
+// An observer sees every stored chunk; after a splice the chunk is read back
+// from the page cache it was just put in, so `out_fd` must be readable.
+class BodyReceiver : public Receiver {
+public:
+    explicit BodyReceiver(bool splice_mode, Observer observer = {})
+        : splice_mode_(splice_mode), observer_(move(observer)) {
+        if (splice_mode_ && pipe2(pipe_, O_CLOEXEC) < 0)
+            splice_mode_ = false;
+        if (splice_mode_) {
+            int cap = fcntl(pipe_[1], F_SETPIPE_SZ, (int)SPLICE_PIPE_SIZE);
+            if (cap < 0)
+                cap = fcntl(pipe_[1], F_GETPIPE_SZ);
+            pipe_cap_ = cap > 0 ? cap : 64 * 1024;
+        }
+    }
+
+    ~BodyReceiver() {
+        if (pipe_[0] != -1)
+            close(pipe_[0]);
+        if (pipe_[1] != -1)
+            close(pipe_[1]);
+    }
+
+    BodyReceiver(const BodyReceiver&) = delete;
+    BodyReceiver& operator=(const BodyReceiver&) = delete;
+
+    ssize_t receive(int sock, int out_fd, uint64_t offset, uint64_t max) override {
+        if (splice_mode_)
+            return receive_splice(sock, out_fd, offset, max);
+        return receive_copy(sock, out_fd, offset, max);
+    }
+
+private:
+    ssize_t receive_copy(int sock, int out_fd, uint64_t offset, uint64_t max) {
+        if (buf_.size() < chunk)
+            buf_.resize(chunk);
+        ssize_t r;
+        do {
+            r = recv(sock, buf_.data(), min<uint64_t>(chunk, max), 0);
+        } while (r < 0 && errno == EINTR);
+        if (r <= 0)
+            return r;
+        auto t0 = Clock::now();
+        bool ok = write_at(out_fd, buf_.data(), r, offset);
+        disk_time += Clock::now() - t0;
+        if (!ok)
+            return -1;
+        if (observer_)
+            observer_(buf_.data(), r);
+        return r;
+    }
+
+    ssize_t receive_splice(int sock, int out_fd, uint64_t offset, uint64_t max) {
+        if (chunk > pipe_cap_ && !pipe_maxed_) {
+            // above fs.pipe-max-size this needs CAP_SYS_RESOURCE
+            int cap = fcntl(pipe_[1], F_SETPIPE_SZ, (int)chunk);
+            pipe_maxed_ = cap < 0;
+            if (cap > 0)
+                pipe_cap_ = cap;
+        }
+        ssize_t r;
+        do {
+            r = splice(sock, nullptr, pipe_[1], nullptr, min<uint64_t>(pipe_cap_, max),
+                       SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0 && errno == EINVAL) {
+            splice_mode_ = false;
+            return receive_copy(sock, out_fd, offset, max);
+        }
+        if (r <= 0)
+            return r;
+
+        auto t0 = Clock::now();
+        loff_t pos = offset;
+        size_t left = r;
+        while (left > 0) {
+            ssize_t n = splice(pipe_[0], nullptr, out_fd, &pos, left, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EINVAL) {
+                // the filesystem can't take splice(); drain the pipe by hand
+                splice_mode_ = false;
+                return drain_pipe(out_fd, pos, left) && observe_stored(out_fd, offset, r) ? r : -1;
+            }
+            if (n <= 0)
+                return -1;
+            left -= n;
+        }
+        disk_time += Clock::now() - t0;
+        return observe_stored(out_fd, offset, r) ? r : -1;
+    }
+
+    // Shows the observer a spliced chunk, read back while it is still in the
+    // page cache, one copy like the client hashing a chunk before sendfile().
+    bool observe_stored(int out_fd, uint64_t offset, size_t len) {
+        if (!observer_)
+            return true;
+        if (buf_.size() < chunk)
+            buf_.resize(chunk);
+        while (len > 0) {
+            ssize_t n = pread(out_fd, buf_.data(), min(buf_.size(), len), offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            observer_(buf_.data(), n);
+            offset += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    bool drain_pipe(int out_fd, uint64_t offset, size_t left) {
+        if (buf_.empty())
+            buf_.resize(BUF_SIZE);
+        while (left > 0) {
+            ssize_t n = read(pipe_[0], buf_.data(), min(BUF_SIZE, left));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0 || !write_at(out_fd, buf_.data(), n, offset))
+                return false;
+            offset += n;
+            left -= n;
+        }
+        return true;
+    }
+
+    bool splice_mode_;
+    Observer observer_;
+    int pipe_[2] = {-1, -1};
+    size_t pipe_cap_ = 0;
+    bool pipe_maxed_ = false;
+    vector<char> buf_;
+};
+
+// Unpacks an OP_COMPRESSED body frame by frame. A frame is collected whole,
+// then decoded and written in one go, so receive() reports progress only
+// when a frame completes.
+class FrameReceiver : public Receiver {
+public:
+    FrameReceiver(uint8_t codec, Observer observer)
+        : codec_(codec), observer_(move(observer)) {
+        if (codec_ != CODEC_NONE)
+            decoder_ = make_unique<Decompressor>(codec_);
+    }
+
+    ssize_t receive(int sock, int out_fd, uint64_t offset, uint64_t max) override {
+        while (!header_parsed_ || have_ < FRAME_HEADER + packed_len_) {
+            size_t want = header_parsed_ ? FRAME_HEADER + packed_len_ : FRAME_HEADER;
+            if (frame_.size() < want)
+                frame_.resize(want);
+            ssize_t r = recv(sock, frame_.data() + have_, want - have_, 0);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                return r;
+            have_ += r;
+            if (!header_parsed_ && have_ == FRAME_HEADER)
+                parse_frame_header(max);
+        }
+
+        const char* payload = frame_.data() + FRAME_HEADER;
+        if (compressed_) {
+            if (raw_.size() < raw_len_)
+                raw_.resize(raw_len_);
+            if (!decoder_->decompress(payload, packed_len_, raw_.data(), raw_len_))
+                throw runtime_error("Corrupt compressed frame");
+            payload = raw_.data();
+        }
+        auto t0 = Clock::now();
+        bool ok = write_at(out_fd, payload, raw_len_, offset);
+        disk_time += Clock::now() - t0;
+        if (!ok)
+            return -1;
+        observer_(payload, raw_len_);
+
+        have_ = 0;
+        header_parsed_ = false;
+        return raw_len_;
+    }
+
+private:
+    static constexpr size_t FRAME_HEADER = 8;
+
+    void parse_frame_header(uint64_t max) {
+        uint32_t raw_len, packed;
+        memcpy(&raw_len, frame_.data(), 4);
+        memcpy(&packed, frame_.data() + 4, 4);
+        raw_len_ = ntohl(raw_len);
+        packed = ntohl(packed);
+        compressed_ = packed & FRAME_COMPRESSED;
+        packed_len_ = packed & ~FRAME_COMPRESSED;
+
+        if (raw_len_ == 0 || raw_len_ > MAX_FRAME_SIZE || raw_len_ > max ||
+            packed_len_ > MAX_FRAME_SIZE || (compressed_ && !decoder_) ||
+            (!compressed_ && packed_len_ != raw_len_))
+            throw runtime_error("Malformed frame");
+        header_parsed_ = true;
+    }
+
+    uint8_t codec_;
+    Observer observer_;
+    unique_ptr<Decompressor> decoder_;
+    vector<char> frame_;  // header + payload of the frame being collected
+    vector<char> raw_;    // decoded payload
+    size_t have_ = 0;
+    bool header_parsed_ = false;
+    bool compressed_ = false;
+    uint32_t raw_len_ = 0;
+    uint32_t packed_len_ = 0;
+};
+
+// ---------- chunk store ----------
+
+// chunks/<first two hex digits>/<id>, one file per chunk. A chunk is written
+// to a temp file and renamed into place, so a reader never sees half of one
+// and two uploads storing the same chunk just race to an identical result.
+fs::path chunk_path(const ChunkId& id) {
+    string hex = id.hex();
+    return CHUNK_STORE / hex.substr(0, 2) / hex;
+}
+
+bool chunk_stored(const ChunkId& id, uint32_t len) {
+    struct stat st;
+    return stat(chunk_path(id).c_str(), &st) == 0 && (uint64_t)st.st_size == len;
+}
+
+void store_chunk(const ChunkId& id, const char* data, size_t len) {
+    fs::path path = chunk_path(id);
+    fs::create_directories(path.parent_path());
+    fs::path tmp;
+    int fd = open_temp(path, tmp);
+    bool ok = fd >= 0 && write_at(fd, data, len, 0);
+    if (fd >= 0)
+        close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        throw runtime_error("Cannot store chunk");
+    }
+}
+
+struct DedupChunk {
+    uint64_t offset;  // within the file
+    uint32_t len;
+    ChunkId id;
+    bool send;  // not in the store, the client sends it
+};
+
+// Builds an OP_DEDUP file in order, one chunk per call. A stored chunk is
+// copied out of the store without touching the socket; a missing one is
+// collected whole, checked against its id and added to the store. Either
+// way receive() reports the chunk's length, so the body counts file bytes,
+// not wire bytes.
+class DedupReceiver : public Receiver {
+public:
+    DedupReceiver(vector<DedupChunk> chunks, Observer observer)
+        : chunks_(move(chunks)), observer_(move(observer)) {}
+
+    ssize_t receive(int sock, int out_fd, uint64_t, uint64_t) override {
+        const DedupChunk& c = chunks_[next_];
+        if (buf_.size() < c.len)
+            buf_.resize(c.len);
 
-        atomic<uint64_t> received_bytes{0};
-        auto start = chrono::steady_clock::now();
-        auto last_report = start;
+        if (c.send) {
+            while (have_ < c.len) {
+                ssize_t r = recv(sock, buf_.data() + have_, c.len - have_, 0);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    return r;
+                have_ += r;
+            }
+            if (!(chunk_id(buf_.data(), c.len) == c.id))
+                throw runtime_error("Chunk does not match its id");
+        }
 
-        vector<char> buf(BUF_SIZE);
-        uint64_t total = 0;
+        auto t0 = Clock::now();
+        if (c.send)
+            store_chunk(c.id, buf_.data(), c.len);
+        else
+            load_chunk(c);
+        bool ok = write_at(out_fd, buf_.data(), c.len, c.offset);
+        disk_time += Clock::now() - t0;
+        if (!ok)
+            return -1;
+        observer_(buf_.data(), c.len);
+
+        have_ = 0;
+        next_++;
+        return c.len;
+    }
 
-        while (total < file_size) {
-            ssize_t r = recv(client_fd, buf.data(),
-                             min<uint64_t>(BUF_SIZE, file_size - total), 0);
+private:
+    void load_chunk(const DedupChunk& c) {
+        ScopedFd fd(open(chunk_path(c.id).c_str(), O_RDONLY | O_CLOEXEC));
+        size_t got = 0;
+        while (fd.fd >= 0 && got < c.len) {
+            ssize_t r = pread(fd.fd, buf_.data() + got, c.len - got, got);
+            if (r < 0 && errno == EINTR)
+                continue;
             if (r <= 0)
-                throw runtime_error("Connection lost");
+                break;
+            got += r;
+        }
+        if (got != c.len)
+            throw runtime_error("Chunk vanished from the store");
+    }
+
+    vector<DedupChunk> chunks_;
+    Observer observer_;
+    size_t next_ = 0;
+    vector<char> buf_;  // the chunk being assembled
+    uint32_t have_ = 0;
+};
+
+// On-disk checkpoint of a resumable upload: how much of <name>.partial is
+// known to be durable, and the XXH64 state over exactly those bytes.
+struct Journal {
+    uint32_t magic = JOURNAL_MAGIC;
+    uint32_t reserved = 0;
+    uint64_t upload_id = 0;
+    uint64_t file_size = 0;
+    uint64_t committed = 0;
+    Xxh64 hash;
+};
+
+struct RangeUpload;
+struct WriteTracker;
+
+// Which header a session expects next; OP_RESUME and the body trailer make
+// some requests multi-step.
+enum class Stage {
+    Request,      // opcode and request fields
+    ResumeStart,  // OP_RESUME: the offset the client restarts from
+    Trailer,      // hash of the body just received
+    BatchRecord,  // OP_BATCH: next file record or the end marker
+    ChunkList,    // OP_DEDUP: lengths and ids of the file's chunks
+};
+
+enum class Phase {
+    Handshake,  // -t: TLS handshake, before any request bytes
+    Header,  // collecting request header fields
+    Body,    // streaming the body into the output file
+    Reply,   // flushing `out` to the socket
+    Send,    // OP_GET: sending the requested range of the file
+    Parked,  // disarmed until another connection wakes it up
+    Done,
+};
+
+// One accepted connection. It is driven by whichever worker gets its epoll
+// event; EPOLLONESHOT guarantees only one worker touches it at a time.
+struct Session {
+    int fd;  // swapped only under sessions_mtx, read by the idle sweep
+    string peer;  // "ip:port"
+    SSL* tls = nullptr;  // until the handshake is done and handed off
+    atomic<int64_t> last_active{0};  // Clock ticks, read by the idle sweep
+
+    Phase phase = Phase::Header;
+    Phase after_reply = Phase::Done;
+    Stage stage = Stage::Request;
+    string in;          // header bytes collected so far
+    size_t need = 0;    // header bytes required before parsing again
+    string out;         // reply bytes not yet sent
+    size_t out_pos = 0;
+
+    uint32_t op = 0;
+    string filename;
+    uint64_t file_size = 0;
+    uint64_t id = 0;      // transfer_id of OP_RANGE, upload_id of OP_RESUME
+    uint64_t offset = 0;  // where the body starts within the file
+    uint64_t length = 0;  // body length
+    uint64_t done = 0;    // body bytes stored so far
+    Xxh64 body_hash;      // over the stored body, unless the journal keeps it
+    uint64_t expected_hash = 0;
+
+    int out_fd = -1;  // file being stored, or the file OP_GET reads from
+    uint8_t codec = CODEC_NONE;  // OP_COMPRESSED
+    uint32_t chunk_count = 0;    // OP_DEDUP
+    unique_ptr<Receiver> rx;
+    shared_ptr<WriteTracker> writes;  // queued disk writes, with the async writer
+    uint64_t synced = 0;              // body bytes covered by the last fdatasync
+
+    optional<SocketTuner> tuner;           // from the first body or download on
+    shared_ptr<TokenBucket> client_limit;  // shared by all connections from this address
+    unique_ptr<TokenBucket> share;         // -F: this body's slice of the total rate
+
+    TransferStats stats;
+    Clock::time_point last_report;
+    bool body_open = false;  // a body began and has no outcome reported yet
+
+    shared_ptr<RangeUpload> range;
+    bool range_landed = false;
+
+    fs::path out_path;
+    fs::path tmp_path;  // where the body lands until published under out_path
+    unordered_set<string> made_dirs;  // OP_BATCH: directories known to exist
+    uint64_t batch_files = 0, batch_failed = 0, batch_bytes = 0;
+    Clock::time_point batch_start;
+
+    bool claimed = false;
+    Journal journal;
+    uint64_t next_checkpoint = 0;
+
+    Session(int fd, const sockaddr_in& addr) : fd(fd) {
+        char ip[INET_ADDRSTRLEN] = "?";
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        peer = string(ip) + ":" + to_string(ntohs(addr.sin_port));
+        stats.requested = Clock::now();
+    }
+};
+
+// State of one multi-stream upload, shared by all OP_RANGE connections that
+// carry the same transfer_id.
+struct RangeUpload {
+    int fd = -1;
+    fs::path path, tmp_path;  // tmp_path is cleared once published
+    uint64_t file_size = 0;
+    // start -> end of every range a stream has taken on. They may not
+    // overlap, so once the intact ones add up to file_size they cover it.
+    map<uint64_t, uint64_t> ranges;
+    uint64_t landed = 0;
+    int streams = 0;
+    bool failed = false;
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline;
+    vector<Session*> waiters;  // streams whose range landed, parked until the rest do
+
+    mutex m;
+
+    ~RangeUpload() {
+        if (fd != -1)
+            close(fd);
+        if (!tmp_path.empty())
+            unlink(tmp_path.c_str());
+    }
+};
+
+mutex range_uploads_mtx;
+unordered_map<uint64_t, shared_ptr<RangeUpload>> range_uploads;
+
+struct ActiveResumable {
+    uint64_t upload_id;
+    Session* owner;
+    Session* waiter;  // reconnect waiting for the stale owner to let go
+};
+
+mutex resumable_mtx;
+unordered_map<string, ActiveResumable> resumable_active;
+
+mutex sessions_mtx;
+unordered_set<Session*> sessions;
+
+mutex gate_mtx;
+size_t active_transfers = 0;
+bool accept_paused = false;
+
+int64_t now_ticks() { return Clock::now().time_since_epoch().count(); }
+
+void arm(int fd, void* tag, uint32_t events) {
+    epoll_event ev{};
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void reply(Session& s, uint8_t status) {
+    s.out.assign(1, (char)status);
+    s.out_pos = 0;
+    s.phase = Phase::Reply;
+    s.after_reply = Phase::Done;
+}
+
+// Hands a parked session back to the workers with `status` queued.
+void wake_with_status(Session& s, uint8_t status) {
+    reply(s, status);
+    s.last_active = now_ticks();
+    arm(s.fd, &s, EPOLLOUT);
+}
+
+// Hands a parked session back to the workers to carry on where it stopped.
+void wake(Session& s) {
+    s.last_active = now_ticks();
+    arm(s.fd, &s, EPOLLOUT);
+}
+
+// Marks the session as waiting for someone else to wake() it. Callers
+// park it under the lock the waker takes, so nobody can wake it early.
+void park(Session& s) {
+    s.last_active = LLONG_MAX;  // waiting on others is not idling
+}
+
+// ---------- rate limits ----------
+
+unique_ptr<TokenBucket> total_limit;
+atomic<int> sharing_bodies{0};
+
+mutex client_limits_mtx;
+unordered_map<in_addr_t, weak_ptr<TokenBucket>> client_limits;
+
+mutex throttle_mtx;
+multimap<Clock::time_point, Session*> throttled;  // parked until the time given
+
+double limit_burst(double rate) { return max<double>(BUF_SIZE, rate * LIMIT_BURST_SECONDS); }
+
+// Every connection from one address draws on the same bucket, so opening
+// more streams doesn't buy a client more bandwidth.
+shared_ptr<TokenBucket> limit_for_client(in_addr_t ip) {
+    if (client_rate <= 0)
+        return nullptr;
+    lock_guard<mutex> lg(client_limits_mtx);
+    auto& slot = client_limits[ip];
+    auto bucket = slot.lock();
+    if (!bucket) {
+        bucket = make_shared<TokenBucket>(client_rate, limit_burst(client_rate));
+        slot = bucket;
+    }
+    return bucket;
+}
+
+void prune_client_limits() {
+    lock_guard<mutex> lg(client_limits_mtx);
+    for (auto it = client_limits.begin(); it != client_limits.end();) {
+        if (it->second.expired())
+            it = client_limits.erase(it);
+        else
+            ++it;
+    }
+}
+
+double fair_rate() { return total_rate / max(1, sharing_bodies.load()); }
+
+void join_share(Session& s) {
+    if (!fair_share)
+        return;
+    int n = ++sharing_bodies;
+    s.share = make_unique<TokenBucket>(total_rate / n, limit_burst(total_rate / n));
+}
+
+void leave_share(Session& s) {
+    if (s.share) {
+        s.share.reset();
+        --sharing_bodies;
+    }
+}
+
+void set_timer(int fd, Clock::time_point when) {
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(when.time_since_epoch()).count();
+    itimerspec t{};
+    t.it_value.tv_sec = ns / 1000000000;
+    t.it_value.tv_nsec = max<int64_t>(ns % 1000000000, 1);  // all zero would disarm it
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &t, nullptr);
+}
+
+// Holds the session back without reading from its socket, so TCP flow
+// control slows the sender down; the throttle timer wakes it at `until`.
+void park_until(Session& s, Clock::time_point until) {
+    park(s);
+    lock_guard<mutex> lg(throttle_mtx);
+    bool earliest = throttled.empty() || until < throttled.begin()->first;
+    throttled.emplace(until, &s);
+    if (earliest)
+        set_timer(throttle_fd, until);
+}
+
+void wake_throttled() {
+    uint64_t expirations;
+    while (read(throttle_fd, &expirations, sizeof(expirations)) > 0) {
+    }
+
+    auto now = Clock::now();
+    {
+        lock_guard<mutex> lg(throttle_mtx);
+        while (!throttled.empty() && throttled.begin()->first <= now) {
+            wake(*throttled.begin()->second);
+            throttled.erase(throttled.begin());
+        }
+        if (!throttled.empty())
+            set_timer(throttle_fd, throttled.begin()->first);
+    }
+    arm(throttle_fd, &THROTTLE_TAG, EPOLLIN);
+}
+
+// Returns true if the session is over one of its limits and was parked
+// until it is back under; it must not be touched afterwards.
+bool throttle(Session& s) {
+    if (!s.client_limit && !total_limit && !s.share)
+        return false;
+    auto now = Clock::now();
+    Clock::duration wait{};
+    if (s.client_limit)
+        wait = max(wait, s.client_limit->wait_time(now));
+    if (total_limit)
+        wait = max(wait, total_limit->wait_time(now));
+    if (s.share) {
+        double rate = fair_rate();
+        s.share->set_rate(rate, limit_burst(rate), now);
+        wait = max(wait, s.share->wait_time(now));
+    }
+    if (wait == Clock::duration::zero())
+        return false;
+    s.stats.wait(TransferStats::Wait::Throttle, now);
+    park_until(s, now + wait);
+    return true;
+}
+
+void charge(Session& s, uint64_t bytes) {
+    if (!s.client_limit && !total_limit && !s.share)
+        return;
+    auto now = Clock::now();
+    if (s.client_limit)
+        s.client_limit->take(bytes, now);
+    if (total_limit)
+        total_limit->take(bytes, now);
+    if (s.share)
+        s.share->take(bytes, now);
+}
+
+// ---------- async disk writer ----------
+
+// Disk writes still queued for one body. Queued writes keep it alive, so
+// the file stays open until the last one has landed even if the
+// connection is already gone.
+struct WriteTracker {
+    int fd;
+    int direct_fd = -1;
+    atomic<bool> direct_ok{false};
+
+    mutex m;
+    size_t pending = 0;
+    bool failed = false;
+    uint64_t unsynced = 0;
+    Session* waiter = nullptr;
+
+    WriteTracker(int out_fd, bool direct) : fd(dup(out_fd)) {
+        if (fd < 0)
+            throw runtime_error("Cannot open output file");
+        if (direct) {
+            string self = "/proc/self/fd/" + to_string(fd);
+            direct_fd = open(self.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+            direct_ok = direct_fd >= 0;
+        }
+    }
+
+    ~WriteTracker() {
+        close(fd);
+        if (direct_fd != -1)
+            close(direct_fd);
+    }
+
+    // Block-aligned chunks bypass the page cache when O_DIRECT is on; the
+    // unaligned head and tail of a body, and filesystems that refuse
+    // O_DIRECT, go through the page cache.
+    bool write(const char* data, size_t len, uint64_t offset) {
+        bool ok = false;
+        if (direct_ok && offset % DIRECT_ALIGN == 0 && len % DIRECT_ALIGN == 0) {
+            ok = write_at(direct_fd, data, len, offset);
+            // only a refused O_DIRECT write says the filesystem can't do it;
+            // errno means nothing when we didn't try
+            if (!ok && errno == EINVAL)
+                direct_ok = false;
+        }
+        if (!ok)
+            ok = write_at(fd, data, len, offset);
+
+        if (ok && sync_interval) {
+            bool due;
+            {
+                lock_guard<mutex> lg(m);
+                unsynced += len;
+                due = unsynced >= sync_interval;
+                if (due)
+                    unsynced = 0;
+            }
+            if (due)
+                ok = fdatasync(fd) == 0;
+        }
+        return ok;
+    }
+
+    void complete(bool ok) {
+        lock_guard<mutex> lg(m);
+        failed |= !ok;
+        if (--pending == 0 && waiter) {
+            wake(*waiter);
+            waiter = nullptr;
+        }
+    }
+
+    // True once every queued write has landed; otherwise parks the session
+    // until they have.
+    bool settle(Session& s) {
+        lock_guard<mutex> lg(m);
+        if (failed)
+            throw runtime_error("Cannot write output file");
+        if (pending == 0)
+            return true;
+        waiter = &s;
+        park(s);
+        return false;
+    }
+};
+
+struct WriteJob {
+    shared_ptr<WriteTracker> tracker;
+    char* buf = nullptr;
+    size_t len = 0;
+    uint64_t offset = 0;
+};
+
+// Decouples the network from the disk: workers fill buffers from a fixed
+// pool of aligned buffers and queue them, writer threads drain the queue.
+// When the pool runs dry the session parks until a buffer comes back,
+// which is the backpressure that keeps a slow disk from eating memory.
+class DiskWriter {
+public:
+    DiskWriter(size_t buffers, int threads) : jobs_(buffers) {
+        for (size_t i = 0; i < buffers; ++i) {
+            char* buf = static_cast<char*>(aligned_alloc(DIRECT_ALIGN, WRITE_BUFFER));
+            if (!buf)
+                throw runtime_error("Cannot allocate write buffers");
+            free_.push_back(buf);
+        }
+        for (int i = 0; i < threads; ++i)
+            thread([this] { run(); }).detach();
+    }
+
+    // Returns nullptr and parks the session if no buffer is free.
+    char* acquire(Session& s) {
+        lock_guard<mutex> lg(m_);
+        if (free_.empty()) {
+            waiters_.push_back(&s);
+            park(s);
+            return nullptr;
+        }
+        char* buf = free_.back();
+        free_.pop_back();
+        return buf;
+    }
+
+    void release(char* buf) {
+        lock_guard<mutex> lg(m_);
+        free_.push_back(buf);
+        if (!waiters_.empty()) {
+            wake(*waiters_.front());
+            waiters_.pop_front();
+        }
+    }
+
+    void submit(WriteJob job) {
+        {
+            lock_guard<mutex> lg(job.tracker->m);
+            job.tracker->pending++;
+        }
+        jobs_.push(move(job));
+    }
+
+private:
+    void run() {
+        WriteJob job;
+        while (jobs_.pop(job)) {
+            bool ok = job.tracker->write(job.buf, job.len, job.offset);
+            release(job.buf);
+            job.tracker->complete(ok);
+            job = WriteJob{};
+        }
+    }
+
+    mutex m_;
+    vector<char*> free_;
+    deque<Session*> waiters_;
+    BoundedQueue<WriteJob> jobs_;  // never full: every job holds a pool buffer
+};
+
+unique_ptr<DiskWriter> disk_writer;
+
+// Receives body bytes into pool buffers and hands them to the disk writer.
+// A buffer is submitted when it reaches the next WRITE_BUFFER boundary of
+// the file or the end of the body, so all but the first and last writes of
+// a body are aligned for O_DIRECT.
+class StagedReceiver : public Receiver {
+public:
+    StagedReceiver(Session& s, Observer observer)
+        : s_(s), observer_(move(observer)) {}
+
+    ~StagedReceiver() {
+        if (buf_)
+            disk_writer->release(buf_);
+    }
+
+    ssize_t receive(int sock, int, uint64_t offset, uint64_t max) override {
+        if (!buf_) {
+            // charged to the disk if the pool is dry and the session parks
+            s_.stats.wait(TransferStats::Wait::Disk, Clock::now());
+            buf_ = disk_writer->acquire(s_);
+            if (!buf_)
+                return PARKED;
+            s_.stats.waiting = TransferStats::Wait::None;
+            buf_offset_ = offset;
+            filled_ = 0;
+            target_ = WRITE_BUFFER - offset % WRITE_BUFFER;
+        }
+
+        ssize_t r;
+        do {
+            r = recv(sock, buf_ + filled_, min<uint64_t>(target_ - filled_, max), 0);
+        } while (r < 0 && errno == EINTR);
+        if (r <= 0)
+            return r;
+        if (observer_)
+            observer_(buf_ + filled_, r);
+        filled_ += r;
+
+        if (filled_ == target_ || (uint64_t)r == max) {
+            disk_writer->submit(WriteJob{s_.writes, buf_, filled_, buf_offset_});
+            buf_ = nullptr;
+        }
+        return r;
+    }
+
+private:
+    Session& s_;
+    Observer observer_;
+    char* buf_ = nullptr;
+    uint64_t buf_offset_ = 0;
+    size_t filled_ = 0;
+    size_t target_ = 0;
+};
+
+// Receiver for a plain body going into s.out_fd: through the disk writer
+// when it runs, straight from the socket otherwise.
+unique_ptr<Receiver> body_receiver(Session& s, Receiver::Observer observer = {}) {
+    if (!disk_writer)
+        return make_unique<BodyReceiver>(use_splice, move(observer));
+    s.writes = make_shared<WriteTracker>(s.out_fd, use_direct);
+    return make_unique<StagedReceiver>(s, move(observer));
+}
+
+fs::path upload_path(const string& filename) {
+    fs::create_directories("uploads");
+    fs::path safe_name = fs::path(filename).filename();
+    return fs::path("uploads") / safe_name;
+}
+
+// Reserves the whole file up front so large uploads land in few extents.
+void preallocate(int fd, uint64_t size) {
+    if (size == 0)
+        return;
+    if (fallocate(fd, 0, 0, size) == 0)
+        return;
+    if ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(fd, size) < 0)
+        throw runtime_error("Cannot preallocate output file");
+}
+
+// Restartable reader over the header bytes collected so far. Parsing starts
+// over on every call; when a field is incomplete, `need` tells how many
+// bytes the header must have before it is worth trying again.
+struct HeaderCursor {
+    const string& buf;
+    size_t pos = 0;
+    size_t need = 0;
+
+    bool take(void* dst, size_t n) {
+        if (pos + n > buf.size()) {
+            need = pos + n;
+            return false;
+        }
+        memcpy(dst, buf.data() + pos, n);
+        pos += n;
+        return true;
+    }
+
+    bool u32(uint32_t& v) {
+        if (!take(&v, sizeof(v)))
+            return false;
+        v = ntohl(v);
+        return true;
+    }
+
+    bool u8(uint8_t& v) { return take(&v, sizeof(v)); }
+
+    bool u64(uint64_t& v) {
+        if (!take(&v, sizeof(v)))
+            return false;
+        v = ntohll(v);
+        return true;
+    }
+
+    bool name(string& out) {
+        uint32_t len;
+        if (!u32(len))
+            return false;
+        if (len == 0 || len > MAX_NAME_LEN)
+            throw runtime_error("Invalid filename length");
+        out.resize(len);
+        return take(out.data(), len);
+    }
+};
+
+bool parse_header(Session& s) {
+    HeaderCursor c{s.in};
+    bool ok;
+    if (s.stage == Stage::Request) {
+        if (!c.u32(s.op)) {
+            s.need = c.need;
+            return false;
+        }
+        if (!is_opcode(s.op) || s.op == OP_UPLOAD) {
+            // legacy upload: the first word is already the name length
+            if (!is_opcode(s.op))
+                c.pos = 0;
+            ok = c.name(s.filename) && c.u64(s.file_size);
+            s.length = s.file_size;
+        } else if (s.op == OP_COMPRESSED) {
+            ok = c.u8(s.codec) && c.name(s.filename) && c.u64(s.file_size);
+            s.length = s.file_size;
+        } else if (s.op == OP_RANGE) {
+            ok = c.u64(s.id) && c.name(s.filename) && c.u64(s.file_size) &&
+                 c.u64(s.offset) && c.u64(s.length);
+        } else if (s.op == OP_RESUME) {
+            ok = c.u64(s.id) && c.name(s.filename) && c.u64(s.file_size);
+        } else if (s.op == OP_BATCH) {
+            ok = true;
+        } else if (s.op == OP_GET) {
+            ok = c.name(s.filename) && c.u64(s.offset) && c.u64(s.length);
+        } else if (s.op == OP_DEDUP) {
+            ok = c.name(s.filename) && c.u64(s.file_size) && c.u32(s.chunk_count);
+            s.length = s.file_size;
+            if (ok && s.chunk_count > MAX_DEDUP_CHUNKS)
+                throw runtime_error("Too many chunks");
+        } else {
+            throw runtime_error("Unknown request type");
+        }
+    } else if (s.stage == Stage::ResumeStart) {
+        ok = c.u64(s.offset);
+    } else if (s.stage == Stage::ChunkList) {
+        // parsed in one go by begin_dedup() once it is all here
+        c.need = (size_t)s.chunk_count * DEDUP_ENTRY_SIZE;
+        ok = s.in.size() >= c.need;
+    } else if (s.stage == Stage::BatchRecord) {
+        // a zero name length ends the batch; it leaves `filename` empty
+        uint32_t len;
+        s.filename.clear();
+        ok = c.u32(len);
+        if (ok && len != 0) {
+            c.pos = 0;
+            ok = c.name(s.filename) && c.u64(s.file_size);
+            s.length = s.file_size;
+        }
+    } else {
+        ok = c.u64(s.expected_hash);
+    }
+    if (!ok)
+        s.need = c.need;
+    return ok;
+}
+
+// Reads exactly as many bytes as the header still lacks, never into the body.
+// Returns false when the socket has nothing more for now.
+bool read_header(Session& s) {
+    while (!parse_header(s)) {
+        size_t have = s.in.size();
+        s.in.resize(s.need);
+        ssize_t r = recv(s.fd, s.in.data() + have, s.need - have, 0);
+        s.in.resize(have + max<ssize_t>(r, 0));
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return false;
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            throw runtime_error("Connection lost");
+    }
+    return true;
+}
+
+bool flush_reply(Session& s) {
+    while (s.out_pos < s.out.size()) {
+        ssize_t n = send(s.fd, s.out.data() + s.out_pos, s.out.size() - s.out_pos, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return false;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw runtime_error("Connection lost");
+        s.out_pos += n;
+    }
+    return true;
+}
+
+// Batch acknowledgements pile up in `out` while the session keeps reading
+// records; they are flushed whenever the socket runs dry.
+bool flush_acks(Session& s) {
+    if (!flush_reply(s))
+        return false;
+    s.out.clear();
+    s.out_pos = 0;
+    return true;
+}
+
+void open_body(Session& s, unique_ptr<Receiver> rx) {
+    s.rx = move(rx);
+    s.done = 0;
+    s.synced = 0;
+    s.last_report = Clock::now();
+    s.stats.begin_body(s.last_report);
+    s.body_open = true;
+    if (!s.tuner)
+        s.tuner.emplace(s.fd, false);
+    s.rx->chunk = s.tuner->chunk();
+    join_share(s);
+    s.phase = Phase::Body;
+}
+
+const char* op_name(uint32_t op) {
+    switch (op) {
+    case OP_RANGE:
+        return "range";
+    case OP_RESUME:
+        return "resume";
+    case OP_UPLOAD:
+        return "upload";
+    case OP_COMPRESSED:
+        return "compressed";
+    case OP_BATCH:
+        return "batch";
+    case OP_GET:
+        return "get";
+    case OP_DEDUP:
+        return "dedup";
+    default:
+        return "legacy";
+    }
+}
+
+// One write per line on an O_APPEND descriptor: lines from concurrent
+// sessions never interleave and nobody takes a lock.
+void emit(const JsonLine& line) {
+    if (json_fd < 0)
+        return;
+    string text = line.str();
+    if (write(json_fd, text.data(), text.size()) < 0) {
+        // a broken feed must not take transfers down with it
+    }
+}
+
+JsonLine stats_line(const Session& s, const char* event, Clock::time_point now) {
+    Clock::duration disk = s.stats.disk_wait + (s.rx ? s.rx->disk_time : Clock::duration{});
+    double elapsed = to_seconds(now - s.stats.body_start);
+    JsonLine line;
+    line.field("event", event)
+        .field("peer", s.peer)
+        .field("op", op_name(s.op))
+        .field("file", s.filename)
+        .field("size", s.file_size)
+        .field("offset", s.offset)
+        .field("length", s.length)
+        .field("bytes", s.done)
+        .field("elapsed", elapsed)
+        .field("rate", s.stats.window.rate(now, s.stats.bytes))
+        .field("avg_rate", elapsed > 0 ? s.done / elapsed : 0.0)
+        .field("ttfb", s.stats.ttfb())
+        .field("net_wait", to_seconds(s.stats.net_wait))
+        .field("disk_wait", to_seconds(disk))
+        .field("throttled", to_seconds(s.stats.throttle_wait));
+    if (s.tuner) {
+        line.field("rtt", s.tuner->rtt())
+            .field("bdp", s.tuner->bdp())
+            .field("sock_buf", (uint64_t)s.tuner->buffer())
+            .field("chunk", (uint64_t)s.tuner->chunk());
+    }
+    return line;
+}
+
+void report_progress(Session& s, uint64_t bytes) {
+    auto now = Clock::now();
+    s.stats.add(now, bytes);
+    if (now - s.last_report < chrono::seconds(3))
+        return;
+    s.last_report = now;
+
+    double elapsed = to_seconds(now - s.stats.body_start);
+    cout << "[Client " << s.peer
+         << "] speed: instant=" << s.stats.window.rate(now, s.stats.bytes)
+         << " B/s, avg=" << s.done / elapsed << " B/s\n";
+    emit(stats_line(s, "progress", now));
+}
+
+void report_final(Session& s, bool ok) {
+    auto now = Clock::now();
+    double elapsed = to_seconds(now - s.stats.body_start);
+    if (s.op != OP_BATCH && elapsed > 0) {
+        cout << "[Client " << s.peer
+             << "] final avg speed: "
+             << (s.done / elapsed) << " B/s\n";
+    }
+    emit(stats_line(s, "done", now).field("ok", ok));
+    s.body_open = false;
+}
+
+void report_failed(Session& s, const string& reason) {
+    emit(stats_line(s, "failed", Clock::now()).field("error", reason));
+    s.body_open = false;
+}
+
+// ---------- single-stream upload ----------
+
+// Hashes the body as it is stored; a spliced chunk is read back for it.
+Receiver::Observer hash_body(Session& s) {
+    return [&s](const char* data, size_t len) { s.body_hash.update(data, len); };
+}
+
+// Opens a temp file for a body that will be published as `path`.
+void open_output(Session& s, const fs::path& path) {
+    s.out_path = path;
+    s.out_fd = open_temp(path, s.tmp_path);
+    if (s.out_fd < 0)
+        throw runtime_error("Cannot open output file");
+    preallocate(s.out_fd, s.file_size);
+}
+
+// Publishes the body if it is intact and drops it otherwise. Returns
+// whether the file now exists under its name (or a versioned one).
+bool publish_output(Session& s, bool intact) {
+    fs::path tmp = move(s.tmp_path);
+    s.tmp_path.clear();
+    if (!intact) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    fs::path name = publish(tmp, s.out_path);
+    if (name.empty())
+        cerr << "[Client " << s.peer << "] " << s.out_path.string() << " exists, upload dropped\n";
+    else if (name != s.out_path)
+        cout << "[Client " << s.peer << "] " << s.out_path.string() << " exists, stored as " << name.string() << "\n";
+    return !name.empty();
+}
+
+void begin_upload(Session& s) {
+    open_output(s, upload_path(s.filename));
+
+    if (s.op == OP_COMPRESSED) {
+        if (!codec_supported(s.codec))
+            s.codec = CODEC_NONE;
+        open_body(s, make_unique<FrameReceiver>(s.codec, hash_body(s)));
+        // the client waits for the codec we settled on before sending frames
+        s.out.assign(1, (char)s.codec);
+        s.out_pos = 0;
+        s.phase = Phase::Reply;
+        s.after_reply = Phase::Body;
+    } else if (s.op == OP_UPLOAD) {
+        open_body(s, body_receiver(s, hash_body(s)));
+    } else {
+        open_body(s, body_receiver(s));
+    }
+}
+
+void finish_upload(Session& s, bool intact) {
+    reply(s, publish_output(s, intact) ? 1 : 0);
+}
+
+// ---------- OP_DEDUP ----------
+
+// Answers the chunk list with the bitmap of chunks to send and starts the
+// body. A chunk that repeats within the file is sent at most once: later
+// copies are read back from the store, which has it by then.
+void begin_dedup(Session& s) {
+    vector<DedupChunk> chunks(s.chunk_count);
+    string bitmap((s.chunk_count + 7) / 8, '\0');
+    unordered_set<string> asked;
+    HeaderCursor c{s.in};
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < s.chunk_count; i++) {
+        DedupChunk& ch = chunks[i];
+        c.u32(ch.len);
+        c.u64(ch.id.lo);
+        c.u64(ch.id.hi);
+        if (ch.len == 0 || ch.len > MAX_DEDUP_CHUNK_SIZE || ch.len > s.file_size - offset)
+            throw runtime_error("Malformed chunk list");
+        ch.offset = offset;
+        offset += ch.len;
+        ch.send = !chunk_stored(ch.id, ch.len) && asked.insert(ch.id.hex()).second;
+        if (ch.send)
+            bitmap[i / 8] |= 1 << (i % 8);
+    }
+    if (offset != s.file_size)
+        throw runtime_error("Malformed chunk list");
+    s.in.clear();
+    s.in.shrink_to_fit();
+
+    open_output(s, upload_path(s.filename));
+    s.body_hash.reset();
+    open_body(s, make_unique<DedupReceiver>(move(chunks), hash_body(s)));
+
+    s.out = move(bitmap);
+    s.out_pos = 0;
+    s.phase = Phase::Reply;
+    s.after_reply = Phase::Body;
+}
+
+// ---------- OP_BATCH ----------
+
+// Maps a relative path from a batch record or an OP_GET under uploads/.
+// Each component is sanitized with filename() as single uploads are, and
+// "." and ".." are refused, so a name can't escape uploads/.
+fs::path stored_path(const string& name) {
+    if (name.front() == '/')
+        throw runtime_error("Absolute path in request");
+
+    fs::path rel;
+    size_t pos = 0;
+    while (pos <= name.size()) {
+        size_t slash = min(name.find('/', pos), name.size());
+        string part = name.substr(pos, slash - pos);
+        pos = slash + 1;
+        if (part.empty())
+            continue;
+        if (part == "." || part == "..")
+            throw runtime_error("Invalid path in request");
+        rel /= fs::path(part).filename();
+    }
+    if (rel.empty())
+        throw runtime_error("Invalid path in request");
+    return fs::path("uploads") / rel;
+}
+
+// Directories are created once per batch.
+fs::path batch_path(Session& s, const string& name) {
+    fs::path path = stored_path(name);
+    string dir = path.parent_path().string();
+    if (s.made_dirs.insert(dir).second)
+        fs::create_directories(dir);
+    return path;
+}
 
-            out.write(buf.data(), r);
-            total += r;
-            received_bytes += r;
+void begin_batch_file(Session& s) {
+    open_output(s, batch_path(s, s.filename));
+    s.body_hash.reset();
+    open_body(s, body_receiver(s, hash_body(s)));
+}
+
+void finish_batch_file(Session& s, bool intact) {
+    close(s.out_fd);
+    s.out_fd = -1;
+    bool stored = publish_output(s, intact);
+    if (!stored)
+        s.batch_failed++;
+    s.batch_files++;
+    s.batch_bytes += s.file_size;
+
+    s.out.push_back((char)(stored ? 1 : 0));
+    s.stage = Stage::BatchRecord;
+    s.in.clear();
+    s.phase = Phase::Header;
+    s.stats.requested = Clock::now();
+}
+
+void finish_batch(Session& s) {
+    double elapsed = to_seconds(Clock::now() - s.batch_start);
+    cout << "[Client " << s.peer
+         << "] batch of " << s.batch_files << " files, " << s.batch_bytes
+         << " bytes, " << s.batch_failed << " failed, avg speed: "
+         << (elapsed > 0 ? s.batch_bytes / elapsed : 0) << " B/s\n";
+    s.phase = Phase::Reply;
+    s.after_reply = Phase::Done;
+}
+
+// ---------- OP_GET ----------
+
+void begin_download(Session& s) {
+    uint64_t file_size = 0, served = 0;
+    s.out_fd = open(stored_path(s.filename).c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (s.out_fd >= 0 && fstat(s.out_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        s.offset <= (uint64_t)st.st_size) {
+        file_size = st.st_size;
+        served = min(s.length, file_size - s.offset);
+    } else if (s.out_fd >= 0) {
+        close(s.out_fd);
+        s.out_fd = -1;
+    }
+
+    uint64_t header[2] = {htonll(file_size), htonll(served)};
+    s.out.assign(1, (char)(s.out_fd >= 0));
+    s.out.append((const char*)header, sizeof(header));
+    s.out_pos = 0;
+    s.file_size = file_size;
+    s.length = served;
+    s.done = 0;
+    s.phase = Phase::Reply;
+    s.after_reply = Phase::Done;
+    if (s.out_fd < 0)
+        return;
+
+    s.last_report = Clock::now();
+    s.stats.begin_body(s.last_report);
+    s.body_open = true;
+    s.tuner.emplace(s.fd, true);
+    s.after_reply = Phase::Send;
+}
+
+// Sends the range straight from the page cache. Returns false when the
+// socket buffer is full or this wakeup used up its budget.
+bool pump_download(Session& s) {
+    uint64_t budget = BODY_BUDGET;
+    while (s.done < s.length) {
+        if (budget == 0)
+            return false;
+        off_t pos = s.offset + s.done;
+        ssize_t n = sendfile(s.fd, s.out_fd, &pos, min(budget, s.length - s.done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            s.stats.wait(TransferStats::Wait::Net, Clock::now());
+            return false;
+        }
+        if (n < 0)
+            throw runtime_error("Connection lost");
+        if (n == 0)
+            throw runtime_error("File truncated while sending");
+        s.done += n;
+        budget -= n;
+        s.tuner->add(n);
+        report_progress(s, n);
+    }
+    return true;
+}
 
-            auto now = chrono::steady_clock::now();
-            if (chrono::duration_cast<chrono::seconds>(now - last_report).count() >= 3) {
-                double elapsed = chrono::duration<double>(now - start).count();
-                double inst = received_bytes.exchange(0) / 3.0;
-                double avg = total / elapsed;
+// ---------- OP_RANGE ----------
 
-                cout << "[Client "
-                     << inet_ntoa(client_addr.sin_addr)
-                     << "] speed: instant=" << inst
-                     << " B/s, avg=" << avg << " B/s\n";
+// Looks up the transfer, creating and preallocating the output file for the
+// first stream that arrives, and claims [offset, offset + length) for this
+// stream. A range that overlaps or repeats another one fails the transfer:
+// adding up lengths would then publish a file with a hole in it.
+shared_ptr<RangeUpload> join_range_upload(uint64_t transfer_id, const string& filename,
+                                          uint64_t file_size, uint64_t offset, uint64_t length) {
+    lock_guard<mutex> lg(range_uploads_mtx);
+    auto& up = range_uploads[transfer_id];
+    if (!up) {
+        auto fresh = make_shared<RangeUpload>();
+        fresh->file_size = file_size;
+        fresh->path = upload_path(filename);
+        fresh->fd = open_temp(fresh->path, fresh->tmp_path);
+        if (fresh->fd < 0) {
+            range_uploads.erase(transfer_id);
+            throw runtime_error("Cannot open output file");
+        }
+        up = fresh;
+        try {
+            preallocate(fresh->fd, file_size);
+        } catch (...) {
+            range_uploads.erase(transfer_id);
+            throw;
+        }
+    }
+    if (up->file_size != file_size)
+        throw runtime_error("File size mismatch between streams");
 
-                last_report = now;
+    lock_guard<mutex> g(up->m);
+    if (length) {
+        auto next = up->ranges.lower_bound(offset);
+        bool overlaps = (next != up->ranges.end() && next->first < offset + length)
+                        || (next != up->ranges.begin() && prev(next)->second > offset);
+        if (overlaps) {
+            if (!up->failed) {
+                up->failed = true;
+                for (Session* w : up->waiters)
+                    wake_with_status(*w, 0);
+                up->waiters.clear();
             }
+            throw runtime_error("Range overlaps another stream's");
+        }
+        up->ranges[offset] = offset + length;
+    }
+    up->streams++;
+    return up;
+}
+
+void leave_range_upload(Session& s) {
+    RangeUpload& up = *s.range;
+    {
+        lock_guard<mutex> g(up.m);
+        if (!s.range_landed && !up.failed) {
+            up.failed = true;
+            for (Session* w : up.waiters)
+                wake_with_status(*w, 0);
+            up.waiters.clear();
+        }
+    }
+    lock_guard<mutex> lg(range_uploads_mtx);
+    lock_guard<mutex> g(up.m);
+    if (--up.streams == 0)
+        range_uploads.erase(s.id);
+}
+
+void begin_range(Session& s) {
+    if (s.offset > s.file_size || s.length > s.file_size - s.offset)
+        throw runtime_error("Range out of bounds");
+    s.range = join_range_upload(s.id, s.filename, s.file_size, s.offset, s.length);
+    s.out_fd = dup(s.range->fd);
+    if (s.out_fd < 0)
+        throw runtime_error("Cannot open output file");
+    open_body(s, body_receiver(s, hash_body(s)));
+}
+
+// Returns false if the session parked until the other ranges land.
+bool range_landed(Session& s, bool intact) {
+    RangeUpload& up = *s.range;
+    lock_guard<mutex> g(up.m);
+    s.range_landed = true;
+    if (!intact && !up.failed) {
+        up.failed = true;
+        for (Session* w : up.waiters)
+            wake_with_status(*w, 0);
+        up.waiters.clear();
+    }
+    up.landed += s.length;
+    if (up.failed) {
+        reply(s, 0);
+        return true;
+    }
+    if (up.landed < up.file_size) {
+        up.waiters.push_back(&s);
+        up.deadline = Clock::now() + RANGE_WAIT_TIMEOUT;
+        s.last_active = LLONG_MAX;  // waiting on peers is not idling
+        s.phase = Phase::Parked;
+        return false;
+    }
+
+    // the last range in publishes the file for all of them
+    bool published = false;
+    try {
+        published = !publish(up.tmp_path, up.path).empty();
+        up.tmp_path.clear();
+    } catch (const exception& e) {
+        cerr << "[Client " << s.peer << "] " << e.what() << "\n";
+    }
+    if (!published) {
+        up.failed = true;
+        for (Session* w : up.waiters)
+            wake_with_status(*w, 0);
+        up.waiters.clear();
+        reply(s, 0);
+        return true;
+    }
+    for (Session* w : up.waiters)
+        wake_with_status(*w, 1);
+    up.waiters.clear();
+
+    double elapsed = to_seconds(Clock::now() - up.start);
+    cout << "[Client " << s.peer
+         << "] range " << s.offset << "+" << s.length
+         << " done, transfer avg speed: "
+         << (elapsed > 0 ? up.file_size / elapsed : 0) << " B/s\n";
+    reply(s, 1);
+    return true;
+}
+
+// ---------- OP_RESUME ----------
+
+bool load_journal(const fs::path& path, Journal& j) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    ScopedFd guard(fd);
+    return read(fd, &j, sizeof(j)) == (ssize_t)sizeof(j) && j.magic == JOURNAL_MAGIC;
+}
+
+// Flushes the partial file, then replaces the journal atomically so a crash
+// never leaves a journal that claims more than the disk holds.
+void save_journal(const fs::path& path, int partial_fd, const Journal& j) {
+    if (fdatasync(partial_fd) < 0)
+        throw runtime_error("Cannot sync partial file");
+
+    fs::path tmp = path;
+    tmp += ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw runtime_error("Cannot write journal");
+    {
+        ScopedFd guard(fd);
+        if (write(fd, &j, sizeof(j)) != (ssize_t)sizeof(j) || fdatasync(fd) < 0)
+            throw runtime_error("Cannot write journal");
+    }
+    if (rename(tmp.c_str(), path.c_str()) < 0)
+        throw runtime_error("Cannot write journal");
+}
+
+fs::path with_suffix(const fs::path& p, const char* suffix) {
+    fs::path r = p;
+    r += suffix;
+    return r;
+}
+
+void checkpoint(Session& s) {
+    s.journal.committed = s.offset + s.done;
+    save_journal(with_suffix(s.out_path, ".journal"), s.out_fd, s.journal);
+    s.next_checkpoint = s.journal.committed + JOURNAL_INTERVAL;
+}
+
+void restart_journal(Session& s) {
+    s.journal = Journal{};
+    s.journal.upload_id = s.id;
+    s.journal.file_size = s.file_size;
+}
+
+// One resumable upload per file name at a time. A reconnect of the same
+// upload takes over from a stale connection that hasn't noticed the drop
+// yet: the old socket is shut down, which makes its owner checkpoint the
+// journal and release the name; the newcomer parks until then. A different
+// upload of the same name is turned away.
+bool claim_resumable(Session& s) {
+    lock_guard<mutex> lg(resumable_mtx);
+    auto it = resumable_active.find(s.out_path.string());
+    if (it == resumable_active.end()) {
+        resumable_active[s.out_path.string()] = ActiveResumable{s.id, &s, nullptr};
+        s.claimed = true;
+        return true;
+    }
+    if (it->second.owner == &s) {
+        s.claimed = true;
+        return true;
+    }
+    if (it->second.upload_id != s.id)
+        throw runtime_error("Upload of this file is already in progress");
+
+    shutdown(it->second.owner->fd, SHUT_RDWR);
+    if (it->second.waiter)
+        wake_with_status(*it->second.waiter, 0);
+    it->second.waiter = &s;
+    s.last_active = LLONG_MAX;
+    s.phase = Phase::Parked;
+    return false;
+}
+
+void release_resumable(Session& s) {
+    lock_guard<mutex> lg(resumable_mtx);
+    auto it = resumable_active.find(s.out_path.string());
+    if (it == resumable_active.end() || it->second.owner != &s)
+        return;
+    Session* w = it->second.waiter;
+    if (!w) {
+        resumable_active.erase(it);
+        return;
+    }
+    // the waiter's header is complete, so on wakeup it re-runs begin_resume()
+    // and finds itself the owner
+    it->second = ActiveResumable{w->id, w, nullptr};
+    w->phase = Phase::Header;
+    w->last_active = now_ticks();
+    arm(w->fd, w, EPOLLOUT);
+}
+
+// Returns false if the session parked behind a stale connection.
+bool begin_resume(Session& s) {
+    s.out_path = upload_path(s.filename);
+    if (!claim_resumable(s))
+        return false;
+
+    fs::path partial_path = with_suffix(s.out_path, ".partial");
+    bool resumable = load_journal(with_suffix(s.out_path, ".journal"), s.journal) &&
+                     s.journal.upload_id == s.id && s.journal.file_size == s.file_size &&
+                     s.journal.committed <= s.file_size && fs::exists(partial_path);
+    if (!resumable)
+        restart_journal(s);
+
+    s.out.resize(16);
+    uint64_t committed = htonll(s.journal.committed);
+    uint64_t prefix_hash = htonll(s.journal.hash.digest());
+    memcpy(s.out.data(), &committed, 8);
+    memcpy(s.out.data() + 8, &prefix_hash, 8);
+    s.out_pos = 0;
+    s.phase = Phase::Reply;
+    s.after_reply = Phase::Header;
+    s.stage = Stage::ResumeStart;
+    s.in.clear();
+    return true;
+}
+
+void begin_resume_body(Session& s) {
+    if (s.offset == 0 && s.journal.committed != 0)
+        restart_journal(s);
+    else if (s.offset != s.journal.committed)
+        throw runtime_error("Resume offset does not match journal");
+
+    int flags = O_RDWR | O_CREAT | (s.offset == 0 ? O_TRUNC : 0);
+    s.out_fd = open(with_suffix(s.out_path, ".partial").c_str(), flags, 0644);
+    if (s.out_fd < 0)
+        throw runtime_error("Cannot open output file");
+    preallocate(s.out_fd, s.file_size);
+
+    if (s.offset > 0) {
+        cout << "[Client " << s.peer
+             << "] resuming " << s.filename << " at " << s.offset << "\n";
+    }
+
+    s.length = s.file_size - s.offset;
+    s.next_checkpoint = s.offset + JOURNAL_INTERVAL;
+    open_body(s, make_unique<BodyReceiver>(use_splice, [&s](const char* data, size_t len) {
+                  s.journal.hash.update(data, len);
+              }));
+}
+
+void finish_resume(Session& s, bool intact) {
+    fs::path partial_path = with_suffix(s.out_path, ".partial");
+    if (!intact) {
+        // the journal vouches for these bytes, so none of them can be trusted
+        fs::remove(with_suffix(s.out_path, ".journal"));
+        fs::remove(partial_path);
+        reply(s, 0);
+        return;
+    }
+    // the journal syncs only up to its last checkpoint
+    if (fdatasync(s.out_fd) < 0)
+        throw runtime_error("Cannot sync output file");
+    bool published = !publish(partial_path, s.out_path).empty();
+    fs::remove(with_suffix(s.out_path, ".journal"));
+    reply(s, published ? 1 : 0);
+}
+
+// ---------- TLS ----------
+
+atomic<bool> logged_offload{false}, logged_relay{false};
+
+// Gives the connection to the kernel if it took over the records, or else
+// swaps the session over to the local end of a user-space relay.
+void hand_off_tls(Session& s) {
+    if (tls_offloaded(s.tls)) {
+        if (!logged_offload.exchange(true))
+            cout << "TLS records handled by the kernel (kTLS)" << endl;
+        SSL_free(s.tls);
+        s.tls = nullptr;
+        tls_nodelay(s.fd, false);
+        return;
+    }
+    {
+        // the idle sweep must never shut down the socket the relay owns
+        lock_guard<mutex> lg(sessions_mtx);
+        int local = tls_relay(s.tls, s.fd, SOCK_NONBLOCK);
+        if (local < 0 && errno == EAGAIN)
+            throw runtime_error("TLS relay: all " + to_string(TLS_RELAY_MAX) + " relay threads busy");
+        if (local < 0)
+            throw runtime_error("TLS relay: " + string(strerror(errno)));
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s.fd, nullptr);
+        s.tls = nullptr;
+        s.fd = local;
+    }
+    if (!logged_relay.exchange(true))
+        cout << "kTLS unavailable, relaying TLS records through user space" << endl;
+    epoll_event ev{};
+    ev.events = EPOLLONESHOT;
+    ev.data.ptr = &s;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s.fd, &ev);
+}
+
+// Returns SSL_ERROR_WANT_READ/WRITE while the handshake is in progress and
+// SSL_ERROR_NONE once it is done and handed off.
+int tls_handshake(Session& s) {
+    if (!s.tls) {
+        s.tls = SSL_new(tls_ctx);
+        if (!s.tls || !SSL_set_fd(s.tls, s.fd))
+            throw runtime_error("TLS: " + tls_error());
+        tls_nodelay(s.fd, true);
+    }
+    int r = SSL_accept(s.tls);
+    if (r == 1) {
+        hand_off_tls(s);
+        return SSL_ERROR_NONE;
+    }
+    int e = SSL_get_error(s.tls, r);
+    if (e != SSL_ERROR_WANT_READ && e != SSL_ERROR_WANT_WRITE)
+        throw runtime_error("TLS handshake failed: " + tls_error());
+    return e;
+}
+
+// ---------- state machine ----------
+
+// Returns false if the session parked; it must not be touched afterwards.
+bool on_body_verified(Session& s) {
+    const Xxh64& stored = s.op == OP_RESUME ? s.journal.hash : s.body_hash;
+    bool intact = !is_opcode(s.op) || stored.digest() == s.expected_hash;
+    if (!intact) {
+        cerr << "[Client " << s.peer
+             << "] checksum mismatch on " << s.filename << "\n";
+    }
+    report_final(s, intact);
+
+    if (s.op == OP_RANGE)
+        return range_landed(s, intact);
+    if (s.op == OP_RESUME)
+        finish_resume(s, intact);
+    else if (s.op == OP_BATCH)
+        finish_batch_file(s, intact);
+    else
+        finish_upload(s, intact);
+    return true;
+}
+
+// Returns false if the session parked; it must not be touched afterwards.
+bool on_header(Session& s) {
+    if (s.stage == Stage::Trailer)
+        return on_body_verified(s);
+    if (s.op == OP_BATCH) {
+        if (s.stage == Stage::Request) {
+            s.batch_start = s.stats.requested = Clock::now();
+            s.stage = Stage::BatchRecord;
+            s.in.clear();
+        } else if (s.filename.empty()) {
+            finish_batch(s);
+        } else {
+            begin_batch_file(s);
+        }
+        return true;
+    }
+    if (!is_opcode(s.op) || s.op == OP_UPLOAD || s.op == OP_COMPRESSED) {
+        begin_upload(s);
+    } else if (s.op == OP_GET) {
+        begin_download(s);
+    } else if (s.op == OP_DEDUP) {
+        if (s.stage == Stage::Request) {
+            s.stage = Stage::ChunkList;
+            s.in.clear();
+        } else {
+            begin_dedup(s);
+        }
+    } else if (s.op == OP_RANGE) {
+        begin_range(s);
+    } else if (s.stage == Stage::Request) {
+        return begin_resume(s);
+    } else {
+        begin_resume_body(s);
+    }
+    return true;
+}
+
+enum class Pump { Done, More, Parked };
+
+// The resume journal syncs on its own schedule, and the disk writer syncs
+// the bodies it writes; the rest follow the fsync policy here.
+void sync_body(Session& s, bool at_end) {
+    if (s.op == OP_RESUME || s.writes)
+        return;
+    bool due = at_end ? sync_at_end : sync_interval && s.done - s.synced >= sync_interval;
+    if (!due)
+        return;
+    if (fdatasync(s.out_fd) < 0)
+        throw runtime_error("Cannot sync output file");
+    s.synced = s.done;
+}
+
+// Done once the whole body is stored (and synced, if the policy says so),
+// More if the socket ran dry or this wakeup used up its budget, Parked if
+// it waits for the disk writer; a parked session must not be touched.
+Pump pump_body(Session& s) {
+    uint64_t budget = BODY_BUDGET;
+    while (s.done < s.length) {
+        if (budget == 0)
+            return Pump::More;
+        if (throttle(s))
+            return Pump::Parked;
+        ssize_t r = s.rx->receive(s.fd, s.out_fd, s.offset + s.done, s.length - s.done);
+        if (r == Receiver::PARKED)
+            return Pump::Parked;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            s.stats.wait(TransferStats::Wait::Net, Clock::now());
+            return Pump::More;
         }
+        if (r <= 0) {
+            if (s.op == OP_RESUME)
+                checkpoint(s);  // everything stored so far is good; keep it
+            throw runtime_error("Connection lost");
+        }
+        s.done += r;
+        budget -= min<uint64_t>(budget, r);
+        charge(s, r);
+        s.tuner->add(r);
+        s.rx->chunk = s.tuner->chunk();
+        report_progress(s, r);
+        if (s.op == OP_RESUME && s.offset + s.done >= s.next_checkpoint)
+            checkpoint(s);
+        sync_body(s, false);
+    }
+
+    if (s.writes) {
+        s.stats.wait(TransferStats::Wait::Disk, Clock::now());
+        if (!s.writes->settle(s))
+            return Pump::Parked;
+        s.stats.resume(Clock::now());
+        if (sync_at_end && fdatasync(s.out_fd) < 0)
+            throw runtime_error("Cannot sync output file");
+        s.writes.reset();
+    }
+    sync_body(s, true);
+    return Pump::Done;
+}
 
-        auto end = chrono::steady_clock::now();
-        double elapsed = chrono::duration<double>(end - start).count();
-        if (elapsed > 0) {
-            cout << "[Client "
-                 << inet_ntoa(client_addr.sin_addr)
-                 << "] final avg speed: "
-                 << (total / elapsed) << " B/s\n";
+// Returns false if the session parked; it must not be touched afterwards.
+bool on_body_done(Session& s) {
+    s.stats.disk_wait += s.rx->disk_time;
+    s.rx.reset();
+    leave_share(s);
+    if (!is_opcode(s.op))
+        return on_body_verified(s);
+
+    s.stage = Stage::Trailer;
+    s.in.clear();
+    s.phase = Phase::Header;
+    return true;
+}
+
+enum class Wait { Read, Write, Parked, Close };
+
+Wait advance(Session& s) {
+    for (;;) {
+        switch (s.phase) {
+        case Phase::Handshake:
+            switch (tls_handshake(s)) {
+            case SSL_ERROR_WANT_READ:
+                return Wait::Read;
+            case SSL_ERROR_WANT_WRITE:
+                return Wait::Write;
+            }
+            s.phase = Phase::Header;
+            break;
+        case Phase::Header:
+            if (!read_header(s))
+                return flush_acks(s) ? Wait::Read : Wait::Write;
+            if (!on_header(s))
+                return Wait::Parked;
+            break;
+        case Phase::Body: {
+            Pump p = pump_body(s);
+            if (p == Pump::Parked)
+                return Wait::Parked;
+            if (p == Pump::More)
+                return flush_acks(s) ? Wait::Read : Wait::Write;
+            if (!on_body_done(s))
+                return Wait::Parked;
+            break;
+        }
+        case Phase::Reply:
+            if (!flush_reply(s))
+                return Wait::Write;
+            s.phase = s.after_reply;
+            break;
+        case Phase::Send:
+            if (!pump_download(s))
+                return Wait::Write;
+            report_final(s, true);
+            s.phase = Phase::Done;
+            break;
+        case Phase::Parked:
+            return Wait::Parked;
+        case Phase::Done:
+            return Wait::Close;
         }
+    }
+}
+
+void transfer_closed() {
+    bool resume_accept;
+    {
+        lock_guard<mutex> lg(gate_mtx);
+        --active_transfers;
+        resume_accept = accept_paused;
+        accept_paused = false;
+    }
+    if (resume_accept)
+        arm(listen_fd, &LISTEN_TAG, EPOLLIN);
+}
 
-        uint8_t status = (total == file_size) ? 1 : 0;
-        send(client_fd, &status, sizeof(status), 0);
+void close_session(Session* s) {
+    {
+        lock_guard<mutex> lg(sessions_mtx);
+        sessions.erase(s);
+    }
+    if (s->range)
+        leave_range_upload(*s);
+    if (s->claimed)
+        release_resumable(*s);
+    leave_share(*s);
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, nullptr);
+    if (s->tls)
+        SSL_free(s->tls);
+    close(s->fd);
+    if (s->out_fd != -1)
+        close(s->out_fd);
+    if (!s->tmp_path.empty())
+        unlink(s->tmp_path.c_str());
+    delete s;
+    transfer_closed();
+}
 
-        out.close();
+void serve(Session* s) {
+    s->last_active = now_ticks();
+    s->stats.resume(Clock::now());
+    Wait w;
+    try {
+        w = advance(*s);
     } catch (const exception& e) {
-        uint8_t status = 0;
-        send(client_fd, &status, sizeof(status), 0);
+        if (s->body_open)
+            report_failed(*s, e.what());
+        // statuses still queued (batch acks) go out ahead of the failure
+        if (s->phase != Phase::Handshake) {
+            s->out.push_back(0);
+            send(s->fd, s->out.data() + s->out_pos, s->out.size() - s->out_pos,
+                 MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
         cerr << "Client error: " << e.what() << endl;
+        w = Wait::Close;
+    }
+
+    switch (w) {
+    case Wait::Read:
+        arm(s->fd, s, EPOLLIN);
+        break;
+    case Wait::Write:
+        arm(s->fd, s, EPOLLOUT);
+        break;
+    case Wait::Parked:
+        break;
+    case Wait::Close:
+        close_session(s);
+        break;
+    }
+}
+
+// Accepts until the backlog is empty or the transfer cap is reached. At the
+// cap the listening socket stays disarmed, so further clients wait in the
+// kernel backlog until a transfer finishes.
+void accept_clients() {
+    for (;;) {
+        {
+            lock_guard<mutex> lg(gate_mtx);
+            if (active_transfers >= max_transfers) {
+                accept_paused = true;
+                return;
+            }
+        }
+
+        sockaddr_in client_addr{};
+        socklen_t len = sizeof(client_addr);
+        int client_fd = accept4(listen_fd, (sockaddr*)&client_addr, &len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            break;
+        }
+
+        {
+            lock_guard<mutex> lg(gate_mtx);
+            ++active_transfers;
+        }
+        Session* s = new Session(client_fd, client_addr);
+        if (tls_ctx)
+            s->phase = Phase::Handshake;
+        s->client_limit = limit_for_client(client_addr.sin_addr.s_addr);
+        s->last_active = now_ticks();
+        {
+            lock_guard<mutex> lg(sessions_mtx);
+            sessions.insert(s);
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = s;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+    }
+    arm(listen_fd, &LISTEN_TAG, EPOLLIN);
+}
+
+// Runs once a second: fails range transfers whose peers never showed up and
+// shuts down connections that went silent. shutdown() wakes the owning
+// worker, which then cleans up as for any dropped connection.
+void housekeeping() {
+    uint64_t expirations;
+    while (read(tick_fd, &expirations, sizeof(expirations)) > 0) {
+    }
+
+    auto now = Clock::now();
+    {
+        lock_guard<mutex> lg(range_uploads_mtx);
+        for (auto& kv : range_uploads) {
+            RangeUpload& up = *kv.second;
+            lock_guard<mutex> g(up.m);
+            if (up.waiters.empty() || now < up.deadline)
+                continue;
+            up.failed = true;
+            for (Session* w : up.waiters)
+                wake_with_status(*w, 0);
+            up.waiters.clear();
+        }
+    }
+
+    int64_t idle_before = (now - IDLE_TIMEOUT).time_since_epoch().count();
+    {
+        lock_guard<mutex> lg(sessions_mtx);
+        for (Session* s : sessions) {
+            if (s->last_active < idle_before)
+                shutdown(s->fd, SHUT_RDWR);
+        }
     }
+    prune_client_limits();
 
-    close(client_fd);
+    arm(tick_fd, &TICK_TAG, EPOLLIN);
+}
+
+void worker_loop() {
+    epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; ++i) {
+            void* tag = events[i].data.ptr;
+            if (tag == &LISTEN_TAG)
+                accept_clients();
+            else if (tag == &TICK_TAG)
+                housekeeping();
+            else if (tag == &THROTTLE_TAG)
+                wake_throttled();
+            else
+                serve(static_cast<Session*>(tag));
+        }
+    }
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        cerr << "Usage: server <port>\n";
+    signal(SIGPIPE, SIG_IGN);
+
+    int workers = max(1u, thread::hardware_concurrency());
+    int opt;
+    bool bad_args = false;
+    bool async_writes = false;
+    const char* json_path = nullptr;
+    const char* tls_pem = nullptr;
+    while ((opt = getopt(argc, argv, "aC:cDf:Fj:l:L:m:Np:t:w:")) != -1) {
+        if (opt == 'a') {
+            async_writes = true;
+        } else if (opt == 'D') {
+            async_writes = use_direct = true;
+        } else if (opt == 'f') {
+            if (strcmp(optarg, "end") == 0) {
+                sync_at_end = true;
+            } else if (strcmp(optarg, "none") != 0) {
+                sync_interval = strtoull(optarg, nullptr, 10) * 1024 * 1024;
+                sync_at_end = true;
+                bad_args |= sync_interval == 0;
+            }
+        } else if (opt == 'c')
+            use_splice = false;
+        else if (opt == 'C')
+            congestion = optarg;
+        else if (opt == 'F')
+            fair_share = true;
+        else if (opt == 'j')
+            json_path = optarg;
+        else if (opt == 'l')
+            bad_args |= (client_rate = strtod(optarg, nullptr) * 1024 * 1024) <= 0;
+        else if (opt == 'L')
+            bad_args |= (total_rate = strtod(optarg, nullptr) * 1024 * 1024) <= 0;
+        else if (opt == 'p') {
+            if (strcmp(optarg, "replace") == 0)
+                on_conflict = Conflict::Replace;
+            else if (strcmp(optarg, "keep") == 0)
+                on_conflict = Conflict::Keep;
+            else if (strcmp(optarg, "version") == 0)
+                on_conflict = Conflict::Version;
+            else
+                bad_args = true;
+        } else if (opt == 't')
+            tls_pem = optarg;
+        else if (opt == 'm')
+            max_transfers = max(1, atoi(optarg));
+        else if (opt == 'N')
+            socket_tuning = false;
+        else if (opt == 'w')
+            workers = max(1, atoi(optarg));
+        else
+            bad_args = true;
+    }
+
+    if (bad_args || argc - optind != 1 || (fair_share && total_rate <= 0)) {
+        cerr << "Usage: server [-a | -D] [-c] [-C algo] [-f none|end|MiB] [-j feed] [-l MiB/s] [-L MiB/s [-F]]\n"
+             << "              [-m max_transfers] [-N] [-p replace|keep|version] [-t pem] [-w workers] <port>\n"
+             << "  -a  write to disk on separate threads through a bounded buffer pool\n"
+             << "  -D  like -a, bypassing the page cache with O_DIRECT\n"
+             << "  -c  receive through a user-space buffer instead of splice()\n"
+             << "  -C  TCP congestion control for client connections, e.g. bbr\n"
+             << "  -f  fdatasync uploads never (default), at the end, or every MiB and at the end;\n"
+             << "      syncing also makes the new directory entry durable\n"
+             << "  -j  append one JSON line per transfer event to a file, FIFO or - for stdout\n"
+             << "  -l  cap uploads from each client address at this rate\n"
+             << "  -L  cap all uploads together at this rate\n"
+             << "  -F  with -L, give every open upload an equal slice of it\n"
+             << "  -m  concurrent transfers before accepting pauses (default 1024)\n"
+             << "  -N  don't size socket buffers and reads from the measured bandwidth-delay\n"
+             << "      product; keep the kernel's autotuning and 64 KiB reads\n"
+             << "  -p  an upload to an existing name replaces it (default), is dropped, or is\n"
+             << "      stored as name.~N~\n"
+             << "  -t  require TLS, with the certificate chain and private key from this PEM file;\n"
+             << "      records go through kTLS when the kernel supports it\n"
+             << "  -w  worker threads (default: one per core)\n";
         return 1;
     }
 
-    int port = stoi(argv[1]);
+    int port = stoi(argv[optind]);
+    remove_stale_temps("uploads");
+    remove_stale_temps(CHUNK_STORE);
+    if (json_path) {
+        json_fd = strcmp(json_path, "-") == 0
+                      ? STDOUT_FILENO
+                      : open(json_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (json_fd < 0) {
+            perror(json_path);
+            return 1;
+        }
+    }
+    if (tls_pem) {
+        string error;
+        tls_ctx = tls_context(true, tls_pem, error);
+        if (!tls_ctx) {
+            cerr << "TLS: " << error << endl;
+            return 1;
+        }
+    }
+    if (total_rate > 0)
+        total_limit = make_unique<TokenBucket>(total_rate, limit_burst(total_rate));
+    if (async_writes)
+        disk_writer = make_unique<DiskWriter>(WRITE_POOL_BUFFERS, DISK_WRITERS);
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_fd < 0) {
         perror("socket");
         return 1;
     }
 
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    // accepted sockets inherit it
+    if (congestion && !set_congestion(server_fd, congestion)) {
+        cerr << "Congestion control " << congestion << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
@@ -127,15 +2364,33 @@ int main(int argc, char* argv[]) {
     }
 
     listen(server_fd, SOMAXCONN);
-    cout << "Server listening on port " << port << endl;
-
-    while (true) {
-        sockaddr_in client_addr{};
-        socklen_t len = sizeof(client_addr);
-        int client_fd = accept(server_fd, (sockaddr*)&client_addr, &len);
-        if (client_fd < 0)
-            continue;
+    listen_fd = server_fd;
 
-        thread(handle_client, client_fd, client_addr).detach();
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    throttle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epoll_fd < 0 || tick_fd < 0 || throttle_fd < 0) {
+        perror("epoll");
+        return 1;
     }
+    itimerspec tick{};
+    tick.it_value.tv_sec = 1;
+    tick.it_interval.tv_sec = 1;
+    timerfd_settime(tick_fd, 0, &tick, nullptr);
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = &LISTEN_TAG;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.ptr = &TICK_TAG;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tick_fd, &ev);
+    ev.data.ptr = &THROTTLE_TAG;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, throttle_fd, &ev);
+
+    cout << "Server listening on port " << port << " with " << workers << " workers" << endl;
+
+    vector<thread> pool;
+    for (int i = 1; i < workers; ++i)
+        pool.emplace_back(worker_loop);
+    worker_loop();
 }
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+// Sizes a TCP socket's buffer and the application's I/O chunk from the
+// bandwidth-delay product of the path, measured while the transfer runs:
+// the RTT from TCP_INFO, the rate from the bytes that went through.
+//
+// Linux already autotunes buffers up to tcp_rmem[2] / tcp_wmem[2], and an
+// explicit SO_RCVBUF / SO_SNDBUF switches that off for the socket and is
+// capped at rmem_max / wmem_max. So the tuner leaves the buffer alone while
+// the kernel can grow it far enough, and only takes over once the path
+// needs more than that; it never shrinks anything. Like the kernel's own
+// receive autotuning it aims at room for twice the BDP it measured: a
+// transfer held back by its buffer measures a BDP of about what fits in
+// it, so the buffer doubles every round until the path, not the buffer,
+// sets the rate.
+
+inline bool socket_tuning = true;  // -N turns it off in both programs
+
+class SocketTuner {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t MIN_CHUNK = 64 * 1024;
+    static constexpr size_t MAX_CHUNK = 4 * 1024 * 1024;
+    static constexpr int MAX_BUFFER = 1 << 30;
+
+    // `sending` picks the buffer that limits this side: the send buffer of
+    // an uploading client, the receive buffer of the server storing it.
+    SocketTuner(int fd, bool sending)
+        : fd_(fd), sending_(sending), off_(!socket_tuning), since_(Clock::now()),
+          next_(since_ + MIN_INTERVAL) {}
+
+    // Counts `n` more bytes through the socket. Looks at TCP_INFO at most
+    // every few RTTs, so it is cheap enough to call after every I/O call.
+    void add(uint64_t n) {
+        bytes_ += n;
+        if (off_)
+            return;
+        auto now = Clock::now();
+        if (now < next_)
+            return;
+
+        tcp_info ti;
+        socklen_t len = sizeof(ti);
+        if (getsockopt(fd_, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) {
+            off_ = true;  // not TCP, e.g. the local end of a TLS relay
+            return;
+        }
+        // the receiver's own estimate is better fed than the one its
+        // ACK-only direction gets, when it has one
+        uint32_t rtt_us = !sending_ && ti.tcpi_rcv_rtt ? ti.tcpi_rcv_rtt : ti.tcpi_rtt;
+        rtt_ = rtt_us / 1e6;
+        double elapsed = std::chrono::duration<double>(now - since_).count();
+        bdp_ = std::max(bdp_, (bytes_ - since_bytes_) / elapsed * rtt_);
+        since_ = now;
+        since_bytes_ = bytes_;
+        next_ = now + std::max<Clock::duration>(
+                          MIN_INTERVAL, std::chrono::duration_cast<Clock::duration>(
+                                            std::chrono::duration<double>(INTERVAL_RTTS * rtt_)));
+
+        // buffer sizes count skb overhead too; about half of one holds data
+        uint64_t target = std::min<uint64_t>(4 * bdp_, MAX_BUFFER);
+        if (!sending_)  // no use buffering more than the window scale lets us advertise
+            target = std::min<uint64_t>(target, uint64_t(2 * 65535) << ti.tcpi_rcv_wscale);
+        if (!capped_)
+            grow_buffer(target);
+        while (chunk_ < MAX_CHUNK && chunk_ < bdp_ / 8)
+            chunk_ *= 2;
+    }
+
+    // How much to hand to one read or write call.
+    size_t chunk() const { return chunk_; }
+    double rtt() const { return rtt_; }
+    double bdp() const { return bdp_; }
+    int buffer() const { return buffer_; }
+
+private:
+    static constexpr auto MIN_INTERVAL = std::chrono::milliseconds(100);
+    static constexpr int INTERVAL_RTTS = 8;
+
+    // One number out of a /proc/sys file; tcp_rmem's third is the most
+    // autotuning will give a receive buffer.
+    static uint64_t sysctl_value(const char* path, int field) {
+        std::ifstream in(path);
+        uint64_t v = 0;
+        for (int i = 0; i <= field && in >> v; i++) {
+        }
+        return v;
+    }
+
+    void grow_buffer(uint64_t target) {
+        int opt = sending_ ? SO_SNDBUF : SO_RCVBUF;
+        int cur = 0;
+        socklen_t len = sizeof(cur);
+        getsockopt(fd_, SOL_SOCKET, opt, &cur, &len);
+        static const uint64_t rmem_auto = sysctl_value("/proc/sys/net/ipv4/tcp_rmem", 2);
+        static const uint64_t wmem_auto = sysctl_value("/proc/sys/net/ipv4/tcp_wmem", 2);
+        static const uint64_t rmem_max = sysctl_value("/proc/sys/net/core/rmem_max", 0);
+        static const uint64_t wmem_max = sysctl_value("/proc/sys/net/core/wmem_max", 0);
+        // while autotuning is on the kernel may still grow the buffer itself
+        uint64_t floor = std::max<uint64_t>(cur, pinned_ ? 0 : sending_ ? wmem_auto : rmem_auto);
+        buffer_ = cur;
+        if (target <= floor)
+            return;
+
+        // the kernel doubles the value for its bookkeeping overhead
+        int half = target / 2;
+        if (setsockopt(fd_, SOL_SOCKET, sending_ ? SO_SNDBUFFORCE : SO_RCVBUFFORCE, &half, sizeof(half)) < 0) {
+            // unprivileged: only up to the *mem_max limit, which may be
+            // below what autotuning reaches anyway
+            uint64_t cap = 2 * (sending_ ? wmem_max : rmem_max);
+            if (cap <= floor) {
+                capped_ = true;
+                return;
+            }
+            half = std::min<uint64_t>(half, cap / 2);
+            capped_ = (uint64_t)half == cap / 2;
+            if (setsockopt(fd_, SOL_SOCKET, opt, &half, sizeof(half)) < 0)
+                return;
+        }
+        pinned_ = true;
+        len = sizeof(buffer_);
+        getsockopt(fd_, SOL_SOCKET, opt, &buffer_, &len);
+    }
+
+    int fd_;
+    bool sending_;
+    bool off_;
+    bool pinned_ = false;  // buffer set by hand, the kernel no longer autotunes it
+    bool capped_ = false;  // and it can't grow any further
+    Clock::time_point since_;  // start of the current measuring interval
+    Clock::time_point next_;
+    uint64_t bytes_ = 0, since_bytes_ = 0;
+    double rtt_ = 0;
+    double bdp_ = 0;
+    size_t chunk_ = MIN_CHUNK;
+    int buffer_ = 0;
+};
+
+// -C: per-socket congestion control, e.g. "bbr". An algorithm outside
+// net.ipv4.tcp_allowed_congestion_control needs CAP_NET_ADMIN.
+inline bool set_congestion(int fd, const char* algo) {
+    return setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, algo, strlen(algo)) == 0;
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Per-transfer telemetry for the lab2 server. A TransferStats belongs to one
+// session and is only touched by the worker currently driving it, so
+// recording costs no locks.
+
+using Clock = std::chrono::steady_clock;
+
+inline double to_seconds(Clock::duration d) { return std::chrono::duration<double>(d).count(); }
+
+// Throughput over the last few seconds, from (time, bytes) samples taken at
+// most every SPACING and kept in a small ring.
+class RateWindow {
+public:
+    static constexpr int SLOTS = 8;
+    static constexpr auto SPACING = std::chrono::milliseconds(500);
+
+    void reset() { count_ = 0; }
+
+    void sample(Clock::time_point now, uint64_t bytes) {
+        if (count_ > 0 && now - ring_[head_].at < SPACING)
+            return;
+        head_ = (head_ + 1) % SLOTS;
+        ring_[head_] = {now, bytes};
+        if (count_ < SLOTS)
+            count_++;
+    }
+
+    // Rate between the oldest kept sample and (now, bytes).
+    double rate(Clock::time_point now, uint64_t bytes) const {
+        if (count_ == 0)
+            return 0;
+        const Sample& oldest = ring_[(head_ - count_ + 1 + SLOTS) % SLOTS];
+        double dt = to_seconds(now - oldest.at);
+        return dt > 0 ? (bytes - oldest.bytes) / dt : 0;
+    }
+
+private:
+    struct Sample {
+        Clock::time_point at;
+        uint64_t bytes;
+    };
+
+    std::array<Sample, SLOTS> ring_{};
+    int head_ = 0;
+    int count_ = 0;
+};
+
+struct TransferStats {
+    enum class Wait { None, Net, Disk, Throttle };
+
+    Clock::time_point requested;   // when the request for this body began
+    Clock::time_point body_start;  // header done, body expected
+    Clock::time_point first_byte;
+    bool got_first_byte = false;
+    uint64_t bytes = 0;
+
+    Clock::duration net_wait{};   // body phase, waiting for the peer to send
+    Clock::duration disk_wait{};  // waiting for, or inside, disk writes
+    Clock::duration throttle_wait{};  // held back by a rate limit
+    Wait waiting = Wait::None;
+    Clock::time_point waiting_since;
+
+    RateWindow window;
+
+    void begin_body(Clock::time_point now) {
+        body_start = now;
+        got_first_byte = false;
+        bytes = 0;
+        net_wait = disk_wait = throttle_wait = {};
+        waiting = Wait::None;
+        window.reset();
+        window.sample(now, 0);
+    }
+
+    void add(Clock::time_point now, uint64_t n) {
+        if (!got_first_byte) {
+            first_byte = now;
+            got_first_byte = true;
+        }
+        bytes += n;
+        window.sample(now, bytes);
+    }
+
+    void wait(Wait kind, Clock::time_point now) {
+        waiting = kind;
+        waiting_since = now;
+    }
+
+    // Called whenever the session runs again; charges the time it was idle
+    // to whatever it was waiting for.
+    void resume(Clock::time_point now) {
+        if (waiting == Wait::Net)
+            net_wait += now - waiting_since;
+        else if (waiting == Wait::Disk)
+            disk_wait += now - waiting_since;
+        else if (waiting == Wait::Throttle)
+            throttle_wait += now - waiting_since;
+        waiting = Wait::None;
+    }
+
+    double ttfb() const { return got_first_byte ? to_seconds(first_byte - requested) : 0; }
+};
+
+// Builds one JSON object on a single line.
+class JsonLine {
+public:
+    JsonLine& field(const char* key, const std::string& value) {
+        start(key);
+        line_ += '"';
+        for (unsigned char c : value) {
+            if (c == '"' || c == '\\') {
+                line_ += '\\';
+                line_ += c;
+            } else if (c < 0x20) {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                line_ += esc;
+            } else {
+                line_ += c;
+            }
+        }
+        line_ += '"';
+        return *this;
+    }
+
+    JsonLine& field(const char* key, const char* value) { return field(key, std::string(value)); }
+
+    JsonLine& field(const char* key, uint64_t value) {
+        start(key);
+        line_ += std::to_string(value);
+        return *this;
+    }
+
+    JsonLine& field(const char* key, double value) {
+        start(key);
+        char num[32];
+        snprintf(num, sizeof(num), "%.6g", value);
+        line_ += num;
+        return *this;
+    }
+
+    JsonLine& field(const char* key, bool value) {
+        start(key);
+        line_ += value ? "true" : "false";
+        return *this;
+    }
+
+    std::string str() const { return line_ + "}\n"; }
+
+private:
+    void start(const char* key) {
+        line_ += line_.size() > 1 ? ",\"" : "\"";
+        line_ += key;
+        line_ += "\":";
+    }
+
+    std::string line_ = "{";
+};
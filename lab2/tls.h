@@ -0,0 +1,238 @@
+#pragma once
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <string>
+#include <thread>
+#include <vector>
+
+// TLS for the lab2 transfer (-t on both sides). OpenSSL only runs the
+// handshake; with SSL_OP_ENABLE_KTLS it then installs the session keys in
+// the kernel, and the socket carries plaintext for us again: sendfile(),
+// splice() and plain send/recv keep working, with the kernel framing and
+// encrypting the records. When the kernel can't take over (no tls module,
+// an OpenSSL built without kTLS, an unsupported cipher) the connection is
+// relayed through a socketpair by a thread doing SSL_read/SSL_write, which
+// keeps the rest of the code unchanged at the cost of two extra copies and
+// a thread per connection. At most TLS_RELAY_MAX relays run at once; past
+// that tls_relay() refuses, and the connection has to be dropped.
+// Link with -lssl -lcrypto.
+//
+// The protocol length-prefixes and hashes everything, so a truncated stream
+// is already caught without close_notify. Neither side sends one: on a kTLS
+// receiver an alert record makes recv() fail with EIO instead of reading 0.
+
+constexpr size_t TLS_RELAY_BUF = 64 * 1024;
+constexpr int TLS_RELAY_MAX = 256;
+
+// Relay threads still running.
+inline std::atomic<int> tls_relays{0};
+
+// Drains OpenSSL's error queue into one line.
+inline std::string tls_error() {
+    std::string msg;
+    char buf[256];
+    while (unsigned long e = ERR_get_error()) {
+        ERR_error_string_n(e, buf, sizeof(buf));
+        if (!msg.empty())
+            msg += "; ";
+        msg += buf;
+    }
+    return msg.empty() ? "connection closed" : msg;
+}
+
+// Server contexts load the certificate chain and private key from `pem`;
+// client contexts trust the certificates in it. Returns nullptr with the
+// reason in `error`.
+inline SSL_CTX* tls_context(bool server, const char* pem, std::string& error) {
+    SSL_CTX* ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+    if (!ctx) {
+        error = tls_error();
+        return nullptr;
+    }
+    // TLS 1.2 with AEAD ciphers is what kTLS offloads in both directions on
+    // every kernel that has it. TLS 1.3 would add post-handshake messages
+    // that a kTLS receiver can only report as errors.
+    bool ok = SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION)
+              && SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION)
+              && SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION
+                                 | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (server) {
+        ok = ok && SSL_CTX_use_certificate_chain_file(ctx, pem) == 1
+             && SSL_CTX_use_PrivateKey_file(ctx, pem, SSL_FILETYPE_PEM) == 1
+             && SSL_CTX_check_private_key(ctx) == 1;
+    } else {
+        ok = ok && SSL_CTX_load_verify_locations(ctx, pem, nullptr) == 1;
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    }
+    if (!ok) {
+        error = std::string(pem) + ": " + tls_error();
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    return ctx;
+}
+
+// Nagle would hold the second write of a handshake flight back until the
+// peer's delayed ACK, ~40 ms per connection, so it is off while handshaking.
+// The relay leaves it off too, since it already sends whatever one recv()
+// from the local end returned as one record; a socket handed to the kernel
+// gets it back so that small sends still coalesce as in plaintext.
+inline void tls_nodelay(int sock, bool on) {
+    int v = on;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
+}
+
+// True once the handshake left both directions of the socket to the kernel.
+inline bool tls_offloaded(SSL* ssl) {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
+
+// Moves bytes between the TLS socket and the local end of the socketpair
+// until both sides have closed or either fails.
+class TlsRelay {
+public:
+    TlsRelay(SSL* ssl, int sock, int local)
+        : ssl_(ssl), sock_(sock), local_(local), down_(TLS_RELAY_BUF), up_(TLS_RELAY_BUF) {}
+
+    ~TlsRelay() {
+        SSL_free(ssl_);
+        close(sock_);
+        close(local_);
+    }
+
+    void run() {
+        while (!(peer_done_ && local_done_)) {
+            sock_events_ = local_events_ = 0;
+            progress_ = false;
+            if (!pump_down() || !pump_up())
+                return;
+            if (progress_)
+                continue;
+            pollfd fds[2] = {{sock_, sock_events_, 0}, {local_, local_events_, 0}};
+            if (poll(fds, 2, -1) < 0 && errno != EINTR)
+                return;
+        }
+    }
+
+private:
+    // peer -> local
+    bool pump_down() {
+        if (down_pos_ == down_len_ && !peer_done_) {
+            int n = SSL_read(ssl_, down_.data(), down_.size());
+            if (n > 0) {
+                down_pos_ = 0;
+                down_len_ = n;
+                progress_ = true;
+            } else if (int e = SSL_get_error(ssl_, n); e == SSL_ERROR_ZERO_RETURN) {
+                peer_done_ = progress_ = true;
+                shutdown(local_, SHUT_WR);
+            } else if (!want(e)) {
+                return false;
+            }
+        }
+        if (down_pos_ < down_len_) {
+            ssize_t n = send(local_, down_.data() + down_pos_, down_len_ - down_pos_, MSG_NOSIGNAL);
+            if (n > 0) {
+                down_pos_ += n;
+                progress_ = true;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                local_events_ |= POLLOUT;
+            } else if (errno != EINTR) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // local -> peer
+    bool pump_up() {
+        if (up_pos_ == up_len_ && !local_done_) {
+            ssize_t n = recv(local_, up_.data(), up_.size(), 0);
+            if (n > 0) {
+                up_pos_ = 0;
+                up_len_ = n;
+                progress_ = true;
+            } else if (n == 0) {
+                local_done_ = progress_ = true;
+                shutdown(sock_, SHUT_WR);
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                local_events_ |= POLLIN;
+            } else if (errno != EINTR) {
+                return false;
+            }
+        }
+        if (up_pos_ < up_len_) {
+            int n = SSL_write(ssl_, up_.data() + up_pos_, up_len_ - up_pos_);
+            if (n > 0) {
+                up_pos_ += n;
+                progress_ = true;
+            } else if (!want(SSL_get_error(ssl_, n))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Records what the socket has to become ready for; false on a real error.
+    bool want(int e) {
+        if (e == SSL_ERROR_WANT_READ)
+            sock_events_ |= POLLIN;
+        else if (e == SSL_ERROR_WANT_WRITE)
+            sock_events_ |= POLLOUT;
+        else
+            return false;
+        return true;
+    }
+
+    SSL* ssl_;
+    int sock_, local_;
+    std::vector<char> down_, up_;
+    size_t down_pos_ = 0, down_len_ = 0, up_pos_ = 0, up_len_ = 0;
+    bool peer_done_ = false, local_done_ = false;
+    bool progress_ = false;
+    short sock_events_ = 0, local_events_ = 0;
+};
+
+// Hands a connected SSL over to a relay thread, which from then on owns it
+// and `sock`. Returns the descriptor to use instead of `sock`, created with
+// `flags` (e.g. SOCK_NONBLOCK), or -1 with errno set and nothing taken over;
+// EAGAIN means TLS_RELAY_MAX relays are already running.
+inline int tls_relay(SSL* ssl, int sock, int flags) {
+    if (tls_relays.fetch_add(1) >= TLS_RELAY_MAX) {
+        --tls_relays;
+        errno = EAGAIN;
+        return -1;
+    }
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        --tls_relays;
+        return -1;
+    }
+    if ((flags & SOCK_NONBLOCK) && fcntl(pair[0], F_SETFL, O_NONBLOCK) < 0) {
+        close(pair[0]);
+        close(pair[1]);
+        --tls_relays;
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    SSL_set_read_ahead(ssl, 1);  // fetch records in bulk, not header then body
+    fcntl(pair[1], F_SETFL, O_NONBLOCK);
+    std::thread([relay = new TlsRelay(ssl, sock, pair[1])] {
+        relay->run();
+        delete relay;
+        --tls_relays;
+    }).detach();
+    return pair[0];
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+// Byte-rate limit for the lab2 server. Readers don't ask for tokens up
+// front: a receive call takes whatever the socket had and is charged
+// afterwards, which may push the bucket into debt. The next read waits
+// until the debt is paid off, so the long-run rate holds no matter how
+// large a single read was.
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // `burst` is how much unused allowance can pile up while idle.
+    TokenBucket(double rate, double burst)
+        : rate_(rate), burst_(burst), tokens_(burst), last_(Clock::now()) {}
+
+    // Changes the rate and burst from now on; time already passed refills
+    // at the old ones. Allowance above the new burst is dropped.
+    void set_rate(double rate, double burst, Clock::time_point now) {
+        std::lock_guard<std::mutex> lg(m_);
+        refill(now);
+        rate_ = rate;
+        burst_ = burst;
+        tokens_ = std::min(tokens_, burst_);
+    }
+
+    // How long until the bucket is out of debt; zero if it already is.
+    Clock::duration wait_time(Clock::time_point now) {
+        std::lock_guard<std::mutex> lg(m_);
+        refill(now);
+        if (tokens_ >= 0)
+            return Clock::duration::zero();
+        return std::chrono::ceil<Clock::duration>(
+            std::chrono::duration<double>(-tokens_ / rate_));
+    }
+
+    void take(uint64_t bytes, Clock::time_point now) {
+        std::lock_guard<std::mutex> lg(m_);
+        refill(now);
+        tokens_ -= bytes;
+    }
+
+private:
+    void refill(Clock::time_point now) {
+        if (now > last_) {
+            tokens_ = std::min(burst_, tokens_ + rate_ * std::chrono::duration<double>(now - last_).count());
+            last_ = now;
+        }
+    }
+
+    std::mutex m_;
+    double rate_;
+    double burst_;
+    double tokens_;
+    Clock::time_point last_;
+};
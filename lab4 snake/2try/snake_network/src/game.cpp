@@ -1,61 +1,176 @@
 #include "game.h"
 #include <algorithm>
 #include <chrono>
-#include <map>
-#include <set>
 #include <iostream>
-#include <random> // <- нужно для placeFood и преобразований в еду
 
 Game::Game() { initDefault(); }
 
 void Game::initDefault() {
-    config_.set_width(40);
-    config_.set_height(20);
-    config_.set_food_static(3);
-    config_.set_state_delay_ms(100);
-    snakes_.clear(); foods_.clear(); placeFood();
+    GameConfig cfg;
+    cfg.set_width(40);
+    cfg.set_height(20);
+    cfg.set_food_static(3);
+    cfg.set_state_delay_ms(100);
+    init(cfg, (uint64_t)std::chrono::high_resolution_clock::now().time_since_epoch().count());
+}
+
+void Game::init(const GameConfig& config, uint64_t seed) {
+    config_ = config;
+    seed_ = seed; rng_.reseed(seed); log_.reset();
+    snakes_ = {}; // not clear(): its bucket count decides the snake order, a replay needs a fresh one
+    foods_.clear(); moves_.clear();
+    int cells = config_.width()*config_.height();
+    grid_.resize(cells); free_.resize(cells);
+    for (int i=0;i<cells;i++) { grid_[i] = {CellKind::EMPTY, i}; free_[i] = i; }
+    snakeBits_.assign(cells/64 + 2, 0);
+    headTick_.assign(cells, 0); headCount_.assign(cells, 0); tickNo_ = 0;
+    placeFood();
 }
 
 GameConfig Game::getConfig() const { return config_; }
 
-void Game::placeFood() {
-    std::mt19937 rng((unsigned)std::chrono::high_resolution_clock::now().time_since_epoch().count());
-    std::uniform_int_distribution<int> wx(0, config_.width()-1), wy(0, config_.height()-1);
+bool Game::recordTo(const std::string& path) {
+    log_.reset(new GameLogWriter);
+    if (!log_->open(path, config_, seed_)) { log_.reset(); return false; }
+    return true;
+}
+
+// FNV-1a over snakes in id order and the food set in cell order
+uint64_t Game::stateHash() const {
+    uint64_t hsh = 14695981039346656037ull;
+    auto mix = [&](uint64_t v) { hsh = (hsh ^ v) * 1099511628211ull; };
+    std::vector<int> ids;
+    for (auto &pr: snakes_) ids.push_back(pr.first);
+    std::sort(ids.begin(), ids.end());
+    for (int id: ids) {
+        auto &s = snakes_.at(id);
+        mix((uint64_t)id); mix((uint64_t)s.dir); mix(s.points.size());
+        for (size_t i=0;i<s.points.size();++i) mix((uint64_t)cellIndex(s.points[i]));
+    }
+    for (size_t i=0;i<grid_.size();++i) if (grid_[i].kind == CellKind::FOOD) mix(i);
+    return hsh;
+}
 
+// Every change of a cell goes through here to keep free_ in step: a cell
+// leaving EMPTY is swap-removed from it, a cell becoming EMPTY is appended.
+void Game::setCell(int i, CellKind kind, int ref) {
+    Cell &c = grid_[i];
+    if (c.kind == CellKind::EMPTY && kind != CellKind::EMPTY) {
+        int moved = free_.back();
+        free_[c.ref] = moved; grid_[moved].ref = c.ref; free_.pop_back();
+    } else if (c.kind != CellKind::EMPTY && kind == CellKind::EMPTY) {
+        ref = (int)free_.size(); free_.push_back(i);
+    } else if (kind == CellKind::EMPTY) {
+        return; // already free, keep its slot
+    }
+    if ((c.kind == CellKind::SNAKE) != (kind == CellKind::SNAKE)) snakeBits_[i >> 6] ^= 1ull << (i & 63);
+    c = {kind, ref};
+}
+
+void Game::addFood(const Coord& c) {
+    setCell(cellIndex(c), CellKind::FOOD, (int)foods_.size());
+    foods_.push_back(c);
+}
+
+// swap-remove: the last food takes the freed slot, its cell follows it
+void Game::removeFood(const Coord& c) {
+    int i = cellAt(c).ref;
+    foods_[i] = foods_.back(); foods_.pop_back();
+    if (i < (int)foods_.size()) cellAt(foods_[i]).ref = i;
+    clearCell(c);
+}
+
+void Game::placeFood() {
+    int w = config_.width();
     int target = config_.food_static();
-    int attempts = 0;
-    while ((int)foods_.size() < target && attempts < 10000) {
-        Coord c{wx(rng), wy(rng)};
-        bool ok=true;
-        for (auto &f: foods_) if (coordEquals(f,c)) { ok=false; break; }
-        if (!ok) { attempts++; continue; }
-        bool onSnake=false;
-        for (auto &s: snakes_) for (auto &p: s.second.points) if (coordEquals(p,c)) onSnake=true;
-        if (!onSnake) foods_.push_back(c);
-        attempts++;
+    while ((int)foods_.size() < target && !free_.empty()) {
+        int i = free_[rng_.below(free_.size())];
+        addFood(Coord{i % w, i / w});
     }
 }
 
+uint64_t Game::snakeBits64(size_t pos) const {
+    size_t k = pos >> 6; int off = pos & 63;
+    uint64_t v = snakeBits_[k] >> off;
+    if (off) v |= snakeBits_[k+1] << (64 - off);
+    return v;
+}
+
+bool Game::squareFree(int cx, int cy) const {
+    int w=config_.width(), h=config_.height();
+    int x0 = ((cx - 2) % w + w) % w;
+    for (int dy=-2; dy<=2; dy++) {
+        int y = ((cy + dy) % h + h) % h;
+        if (x0 + 5 <= w) {
+            if (snakeBits64((size_t)y*w + x0) & 31) return false;
+        } else {
+            for (int dx=0; dx<5; dx++) if (cellAt(Coord{(x0+dx)%w, y}).kind == CellKind::SNAKE) return false;
+        }
+    }
+    return true;
+}
+
+// head at (cx,cy) inside a square without snakes, tail on a random
+// neighbour; the snake starts off moving away from its tail
+bool Game::spawnAt(int cx, int cy, int id) {
+    int w=config_.width(), h=config_.height();
+    if (cellAt(Coord{cx,cy}).kind != CellKind::EMPTY) return false;
+    static const struct { int dx, dy; Direction away; } sides[4] = {
+        {1, 0, Direction::LEFT}, {-1, 0, Direction::RIGHT}, {0, 1, Direction::UP}, {0, -1, Direction::DOWN}};
+    int first = (int)rng_.below(4);
+    for (int k=0; k<4; k++) {
+        auto &sd = sides[(first + k) % 4];
+        Coord tail{(cx + sd.dx + w) % w, (cy + sd.dy + h) % h};
+        if (cellAt(tail).kind != CellKind::EMPTY) continue;
+        SnakeInfo s; s.player_id = id;
+        s.points.push_back(Coord{cx,cy}); s.points.push_back(tail);
+        s.dir = sd.away; s.alive=true; s.keepsTail=false;
+        setSnakeCell(Coord{cx,cy}, id); setSnakeCell(tail, id);
+        snakes_[id]=s;
+        return true;
+    }
+    return false;
+}
+
 int Game::addLocalPlayer(const std::string& /*name*/, int id) {
-    SnakeInfo s; s.player_id = id; s.points.clear();
+    if (log_) log_->join(id);
+    if (snakes_.count(id)) return -1; // its old body would stay on the grid, owned by nobody
     int w=config_.width(), h=config_.height();
-    bool placed=false;
-    for (int y=0;y<h && !placed;y++) for (int x=0;x<w && !placed;x++) {
-        Coord c1{x,y}, c2{(x+1)%w,y};
-        bool ok=true;
-        for (auto &sn: snakes_) for (auto&p: sn.second.points) if (coordEquals(p,c1) || coordEquals(p,c2)) ok=false;
-        for (auto &f: foods_) if (coordEquals(f,c1) || coordEquals(f,c2)) ok=false;
-        if (!ok) continue;
-        s.points.push_back(c1); s.points.push_back(c2); s.dir = Direction::RIGHT; s.alive=true;
-        snakes_[id]=s; placed=true; break;
+    // a random free cell is usually the middle of a free square
+    for (int tries=0; tries<32 && !free_.empty(); tries++) {
+        int i = free_[rng_.below(free_.size())];
+        if (squareFree(i % w, i / w) && spawnAt(i % w, i / w, id)) return 0;
+    }
+    // crowded field: look at every square, a word of the snake bitmap at a
+    // time: OR five rows, then keep the bits that start five free cells
+    int ys = (int)rng_.below(h);
+    for (int k=0; k<h; k++) {
+        int y0 = (ys + k) % h;
+        for (int x0=0; x0 + 5 <= w; x0 += 60) {
+            uint64_t occ = 0;
+            for (int dy=0; dy<5; dy++) occ |= snakeBits64((size_t)((y0 + dy) % h)*w + x0);
+            uint64_t f = ~occ, run = f & f>>1 & f>>2 & f>>3 & f>>4;
+            int starts = std::min(60, w - 4 - x0);
+            run &= (1ull << starts) - 1;
+            for (; run; run &= run - 1) {
+                if (spawnAt(x0 + __builtin_ctzll(run) + 2, (y0 + 2) % h, id)) return 0;
+            }
+        }
+        // squares wrapping around the right edge
+        for (int x0=std::max(0, w-4); x0<w; x0++) {
+            int cx = (x0 + 2) % w, cy = (y0 + 2) % h;
+            if (squareFree(cx, cy) && spawnAt(cx, cy, id)) return 0;
+        }
     }
-    if (!placed) return -1;
-    return 0;
+    return -1;
 }
 
 int Game::removeLocalPlayer(int id) {
+    if (log_) log_->leave(id);
     auto it = snakes_.find(id);
     if (it != snakes_.end()) {
+        auto &pts = it->second.points;
+        for (size_t i=0;i<pts.size();++i) if (cellAt(pts[i]).kind==CellKind::SNAKE && cellAt(pts[i]).ref==id) clearCell(pts[i]);
         snakes_.erase(it);
         return 0;
     }
@@ -64,6 +179,8 @@ int Game::removeLocalPlayer(int id) {
 
 
 bool Game::steer(int player_id, Direction d) {
+    if (!Direction_IsValid(d)) return false;
+    if (log_) log_->steer(player_id, d);
     auto it = snakes_.find(player_id);
     if (it==snakes_.end()) return false;
     auto &s = it->second;
@@ -73,27 +190,21 @@ bool Game::steer(int player_id, Direction d) {
 }
 
 bool Game::isCellOccupiedBySnake(int x,int y) const {
-    for (auto &pr: snakes_) for (auto &p: pr.second.points) if (p.x==x && p.y==y) return true;
-    return false;
+    return cellAt(Coord{x,y}).kind == CellKind::SNAKE;
 }
 
-void Game::tick(std::vector<int>& ate_ids, std::vector<int>& died_ids) {
-    ate_ids.clear(); died_ids.clear();
-    if (snakes_.empty()) { placeFood(); return; }
+void Game::forEachMove(void (Game::*step)(size_t, size_t)) {
+    size_t n = moves_.size();
+    size_t shards = pool_ ? std::min(pool_->size() * 4, n / MIN_SHARD) : 0;
+    if (shards <= 1) { (this->*step)(0, n); return; }
+    size_t per = (n + shards - 1) / shards;
+    pool_->run(shards, [&](size_t i) { (this->*step)(i * per, std::min(n, (i + 1) * per)); });
+}
 
+void Game::moveHeads(size_t begin, size_t end) {
     int w = config_.width(), h = config_.height();
-    struct NewSnake { int id; std::vector<Coord> newpoints; Direction dir; bool wasAlive; bool ateFood; };
-    std::unordered_map<int, NewSnake> newSnakes;
-
-    auto foodIndex = [&](const Coord& c)->int{
-        for (size_t i=0;i<foods_.size();++i) if (coordEquals(foods_[i], c)) return (int)i;
-        return -1;
-    };
-
-    // 1) compute new heads/bodies
-    for (auto &pr: snakes_) {
-        auto s = pr.second; // copy
-        NewSnake ns; ns.id = s.player_id; ns.dir = s.dir; ns.wasAlive = s.alive; ns.ateFood=false;
+    for (size_t i=begin; i<end; ++i) {
+        SnakeInfo &s = *order_[i];
         Coord head = s.points.front();
         switch (s.dir) {
             case Direction::UP: head.y = (head.y - 1 + h) % h; break;
@@ -101,121 +212,98 @@ void Game::tick(std::vector<int>& ate_ids, std::vector<int>& died_ids) {
             case Direction::LEFT: head.x = (head.x - 1 + w) % w; break;
             case Direction::RIGHT: head.x = (head.x + 1) % w; break;
         }
-        ns.newpoints = s.points;
-        ns.newpoints.insert(ns.newpoints.begin(), head);
+        bool ate = cellAt(head).kind==CellKind::FOOD;
+        s.keepsTail = ate;
+        moves_[i] = Move{&s, head, ate, false, -1};
+    }
+}
 
-        int fi = foodIndex(head);
-        if (fi != -1) {
-            ns.ateFood = true;
-        } else {
-            if (!ns.newpoints.empty()) ns.newpoints.pop_back();
+// A head dies when another head enters the same cell, or when it enters a
+// body (own included). The tail of a snake that didn't eat leaves this tick,
+// so a head may follow into it.
+void Game::findCollisions(size_t begin, size_t end) {
+    for (size_t i=begin; i<end; ++i) {
+        Move &m = moves_[i];
+        const Cell &c = cellAt(m.head);
+        if (c.kind == CellKind::SNAKE) {
+            const SnakeInfo &owner = snakes_.find(c.ref)->second;
+            if (owner.keepsTail || !coordEquals(owner.points.back(), m.head)) m.victim = c.ref;
         }
-        newSnakes[ns.id] = ns;
+        m.dies = headCount_[cellIndex(m.head)] > 1 || m.victim != -1;
     }
+}
 
-    // 2) build occupancy
-    struct CellOccupant { std::vector<int> heads; std::vector<int> bodies; };
-    std::map<std::pair<int,int>, CellOccupant> occ;
-    for (auto &pr: newSnakes) {
-        const auto &ns = pr.second;
-        if (ns.newpoints.empty()) continue;
-        auto hcoord = ns.newpoints.front();
-        occ[{hcoord.x, hcoord.y}].heads.push_back(ns.id);
-        for (size_t i=1;i<ns.newpoints.size();++i) occ[{ns.newpoints[i].x, ns.newpoints[i].y}].bodies.push_back(ns.id);
-    }
+// The grid always describes the field between ticks. A tick moves every snake
+// in place, touching only the cells under the heads and tails that move, so
+// its cost follows the number of snakes, not their total length. Heads and
+// collisions are worked out against the unchanged field, in parallel when
+// there is a pool; the field itself is then updated on this thread, in
+// snake order, so that e.g. free_ ends up the same as in a serial tick.
+void Game::tick(std::vector<int>& ate_ids, std::vector<int>& died_ids) {
+    ate_ids.clear(); died_ids.clear();
+    if (log_) log_->tick();
+    if (snakes_.empty()) { placeFood(); return; }
 
-    // 3) collisions
-    std::set<int> willDie;
-    for (auto &c : occ) {
-        if (c.second.heads.size() > 1) {
-            for (int pid: c.second.heads) willDie.insert(pid);
-        }
-    }
-    for (auto &c : occ) {
-        if (!c.second.heads.empty() && !c.second.bodies.empty()) {
-            for (int pid: c.second.heads) willDie.insert(pid);
-        }
-    }
+    ++tickNo_;
 
-    // victim gains (not applied to scores here, caller may use it)
-    std::multimap<int,int> victimGains;
-    for (auto &c : occ) {
-        if (!c.second.heads.empty() && !c.second.bodies.empty()) {
-            for (int hitter : c.second.heads) {
-                for (int victim : c.second.bodies) {
-                    victimGains.insert({victim, 1});
-                }
-            }
-        }
-    }
+    // 1) compute new heads; food is whatever the grid has under them
+    order_.clear();
+    for (auto &pr: snakes_) order_.push_back(&pr.second);
+    moves_.resize(order_.size());
+    forEachMove(&Game::moveHeads);
 
-    // 4) compute eaten foods set and remove them
-    std::set<std::pair<int,int>> foodEatenPositions;
-    for (auto &kv : newSnakes) {
-        if (kv.second.ateFood && !kv.second.newpoints.empty()) {
-            auto c = kv.second.newpoints.front();
-            foodEatenPositions.insert({c.x,c.y});
-        }
+    // 2) collisions: count heads per cell, then check every head
+    for (auto &m: moves_) {
+        int c = cellIndex(m.head);
+        if (headTick_[c] != tickNo_) { headTick_[c] = tickNo_; headCount_[c] = 0; }
+        if (headCount_[c] < 2) headCount_[c]++;
     }
-    std::vector<Coord> newFoods;
-    for (auto &f : foods_) {
-        if (foodEatenPositions.count({f.x,f.y})==0) newFoods.push_back(f);
+    forEachMove(&Game::findCollisions);
+
+    // 3) tails of snakes that didn't eat leave the field
+    for (auto &m: moves_) {
+        if (m.ate) continue;
+        auto &pts = m.snake->points;
+        clearCell(pts.back()); pts.pop_back();
     }
-    foods_.swap(newFoods);
 
-    // 5) apply newSnakes to snakes_ (mark died or update)
-    for (auto &kv : newSnakes) {
-        int id = kv.first;
-        if (willDie.count(id)) {
-            snakes_[id].points = kv.second.newpoints;
-            snakes_[id].dir = kv.second.dir;
-            snakes_[id].alive = false; // mark dead — will be fully removed below (and turned into food)
-            died_ids.push_back(id);
+    // 4) eaten food disappears, also under heads that die there
+    for (auto &m: moves_) if (m.ate && cellAt(m.head).kind==CellKind::FOOD) removeFood(m.head);
+
+    // 5) apply moves (mark died or take the head cell)
+    for (auto &m: moves_) {
+        auto &s = *m.snake;
+        s.points.push_front(m.head);
+        if (m.dies) {
+            s.alive = false; // mark dead — will be fully removed below (and turned into food)
+            died_ids.push_back(s.player_id);
         } else {
-            snakes_[id].points = kv.second.newpoints;
-            snakes_[id].dir = kv.second.dir;
-            snakes_[id].alive = true;
-            if (kv.second.ateFood) ate_ids.push_back(id);
+            setSnakeCell(m.head, s.player_id);
+            if (m.ate) ate_ids.push_back(s.player_id);
         }
     }
 
     // 6) log victim gains (caller may use)
-    for (auto it = victimGains.begin(); it != victimGains.end(); ++it) {
-        int victim = it->first;
-        if (std::find(died_ids.begin(), died_ids.end(), victim) == died_ids.end()) {
-            std::cerr << "Victim " << victim << " was crashed into and should get +1 (if not dead itself)\n";
+    for (auto &m: moves_) {
+        if (m.victim != -1 && snakes_[m.victim].alive) {
+            std::cerr << "Victim " << m.victim << " was crashed into and should get +1 (if not dead itself)\n";
         }
     }
 
-    // 7) for each died snake, convert some cells to food with p=0.5, otherwise empty
-    std::mt19937 rng((unsigned)std::chrono::high_resolution_clock::now().time_since_epoch().count());
-    std::bernoulli_distribution half(0.5);
-    // collect cells to add to foods
-    std::vector<Coord> foodsToAdd;
+    // 7) for each died snake, convert some cells to food with p=0.5, otherwise empty;
+    //    a cell still held by a living snake stays with it
     for (int did : died_ids) {
-        auto it = snakes_.find(did);
-        if (it == snakes_.end()) continue;
-        auto &sinfo = it->second;
-        for (auto &p: sinfo.points) {
-            if (half(rng)) {
-                // check not occupied by other alive snake (just in case)
-                bool onSnake = false;
-                for (auto &pr: snakes_) {
-                    if (pr.first==did) continue;
-                    for (auto &pp: pr.second.points) if (coordEquals(pp,p)) onSnake=true;
-                }
-                if (!onSnake) foodsToAdd.push_back(p);
-            }
-        }
+        auto &pts = snakes_[did].points;
+        for (size_t i=0;i<pts.size();++i) if (cellAt(pts[i]).kind==CellKind::SNAKE && cellAt(pts[i]).ref==did) clearCell(pts[i]);
     }
-    // add new foods (deduplicate)
-    for (auto &f : foodsToAdd) {
-        bool exists=false;
-        for (auto &ff: foods_) if (coordEquals(ff,f)) { exists=true; break; }
-        if (!exists) foods_.push_back(f);
+    for (int did : died_ids) {
+        auto &pts = snakes_[did].points;
+        for (size_t i=0;i<pts.size();++i) {
+            if (rng_.coin() && cellAt(pts[i]).kind==CellKind::EMPTY) addFood(pts[i]);
+        }
     }
 
-    // 8) remove died snakes from map (they're dead — cells already converted above)
+    // 8) remove died snakes from map
     for (int did : died_ids) {
         snakes_.erase(did);
     }
@@ -231,8 +319,9 @@ GameState Game::toProto(int64_t state_order) const {
         s.set_player_id(pr.second.player_id);
         s.set_state(GameState::Snake::ALIVE); // all snakes that remain are alive in map
         s.set_head_direction(pr.second.dir);
-        for (auto &p: pr.second.points) {
-            GameState::Coord* c = s.add_points(); c->set_x(p.x); c->set_y(p.y);
+        auto &pts = pr.second.points;
+        for (size_t i=0;i<pts.size();++i) {
+            GameState::Coord* c = s.add_points(); c->set_x(pts[i].x); c->set_y(pts[i].y);
         }
         *gs.add_snakes() = s;
     }
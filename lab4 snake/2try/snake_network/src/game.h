@@ -1,34 +1,127 @@
 #pragma once
 #include "snakes.pb.h"
+#include "game_log.h"
+#include "rng.h"
+#include "worker_pool.h"
 #include <vector>
 #include <unordered_map>
 #include <cstdint>
-#include <random>
+#include <memory>
 
 using namespace snakes;
 
 struct Coord { int x; int y; };
 
+// Snake body as a ring buffer, head first: a tick pushes the head and pops the
+// tail in O(1), and the buffer only reallocates when the snake outgrows it.
+class SnakeBody {
+public:
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const Coord& operator[](size_t i) const { return buf_[(head_ + i) & (buf_.size() - 1)]; }
+    const Coord& front() const { return (*this)[0]; }
+    const Coord& back() const { return (*this)[size_ - 1]; }
+
+    void push_front(const Coord& c) {
+        if (size_ == buf_.size()) grow();
+        head_ = (head_ - 1) & (buf_.size() - 1);
+        buf_[head_] = c; size_++;
+    }
+    void push_back(const Coord& c) {
+        if (size_ == buf_.size()) grow();
+        buf_[(head_ + size_) & (buf_.size() - 1)] = c; size_++;
+    }
+    void pop_back() { size_--; }
+    void clear() { head_ = 0; size_ = 0; }
+
+private:
+    // capacity stays a power of two so that wrapping is a mask
+    void grow() {
+        std::vector<Coord> bigger(buf_.empty() ? 4 : buf_.size() * 2);
+        for (size_t i = 0; i < size_; ++i) bigger[i] = (*this)[i];
+        buf_.swap(bigger); head_ = 0;
+    }
+    std::vector<Coord> buf_;
+    size_t head_ = 0, size_ = 0;
+};
+
 class Game {
 public:
     Game();
-    void initDefault();
+    void initDefault(); // 40x20, seeded from the clock
+    // empty field of config's size, e.g. 1000x1000 with 10k snakes; the same
+    // seed and the same calls give the same game
+    void init(const GameConfig& config, uint64_t seed);
+    uint64_t seed() const { return seed_; }
+    // log every input from now on for replayGameLog(); call right after init
+    bool recordTo(const std::string& path);
     void placeFood(); // ensure at least food_static present (subject to field full)
-    int addLocalPlayer(const std::string& name, int id); // place 2-cell snake for new player
+    // place 2-cell snake for new player: head in the middle of a 5x5 square
+    // without snakes, tail next to it, neither on food; -1 if there's no
+    // room or the id already has a snake
+    int addLocalPlayer(const std::string& name, int id);
     int removeLocalPlayer(int id);
     bool steer(int player_id, Direction d);
 
     // execute one tick: fills ate_ids and died_ids
     void tick(std::vector<int>& ate_ids, std::vector<int>& died_ids);
+    // spread big ticks over a pool (may be shared between games); null: tick
+    // on the calling thread only. The outcome is the same either way.
+    void setWorkers(std::shared_ptr<WorkerPool> pool) { pool_ = std::move(pool); }
 
     GameState toProto(int64_t state_order) const;
     GameConfig getConfig() const;
+    uint64_t stateHash() const; // compare replays and peers without a full dump
 
 private:
     GameConfig config_;
-    struct SnakeInfo { int player_id; std::vector<Coord> points; Direction dir; bool alive; };
+    uint64_t seed_ = 0;
+    Rng rng_; // every random choice of the engine, nothing else draws from it
+    std::unique_ptr<GameLogWriter> log_;
+    struct SnakeInfo { int player_id; SnakeBody points; Direction dir; bool alive; bool keepsTail; /* ate this tick */ };
     std::unordered_map<int, SnakeInfo> snakes_;
     std::vector<Coord> foods_;
+
+    // Occupancy of every cell, kept in step with snakes_ and foods_ so that
+    // collisions and food are one lookup instead of a scan over all bodies.
+    // ref is the owner's player id for SNAKE cells, the index into foods_ for
+    // FOOD and the index into free_ for EMPTY.
+    enum class CellKind : uint8_t { EMPTY, FOOD, SNAKE };
+    struct Cell { CellKind kind; int ref; };
+    std::vector<Cell> grid_; // width*height, row by row
+    std::vector<int> free_;  // indices of all EMPTY cells, in no order: random free cell in O(1)
+    // one bit per SNAKE cell by cell index (plus a spare word), so a row of
+    // a 5x5 spawn square is one shift and a whole row of the field is w/64 words
+    std::vector<uint64_t> snakeBits_;
+
+    // per-tick scratch, kept between ticks so that a tick doesn't allocate
+    struct Move { SnakeInfo* snake; Coord head; bool ate; bool dies; int victim; };
+    std::vector<SnakeInfo*> order_; // snakes in the order of this tick's moves_
+    std::vector<Move> moves_;
+    std::vector<uint32_t> headTick_; // tick that last counted a head in the cell
+    std::vector<uint8_t> headCount_;
+    uint32_t tickNo_ = 0;
+
+    // Parallel steps of a tick, over moves_[begin, end). They only read the
+    // field as it was before the tick and write their own moves, so sharding
+    // can't change the result.
+    static constexpr size_t MIN_SHARD = 512;
+    std::shared_ptr<WorkerPool> pool_;
+    void forEachMove(void (Game::*step)(size_t, size_t));
+    void moveHeads(size_t begin, size_t end);
+    void findCollisions(size_t begin, size_t end);
+
     bool coordEquals(const Coord&a,const Coord&b) const { return a.x==b.x && a.y==b.y; }
+    int cellIndex(const Coord& c) const { return c.y*config_.width() + c.x; }
+    Cell& cellAt(const Coord& c) { return grid_[cellIndex(c)]; }
+    const Cell& cellAt(const Coord& c) const { return grid_[cellIndex(c)]; }
+    void setCell(int i, CellKind kind, int ref);
+    void setSnakeCell(const Coord& c, int id) { setCell(cellIndex(c), CellKind::SNAKE, id); }
+    void clearCell(const Coord& c) { setCell(cellIndex(c), CellKind::EMPTY, 0); }
+    void addFood(const Coord& c);
+    uint64_t snakeBits64(size_t pos) const; // 64 snake bits from cell index pos on
+    bool squareFree(int cx, int cy) const;  // no snake within 2 cells of (cx,cy)
+    bool spawnAt(int cx, int cy, int id);
+    void removeFood(const Coord& c);
     bool isCellOccupiedBySnake(int x,int y) const;
 };
@@ -0,0 +1,73 @@
+#include "game_log.h"
+#include "game.h"
+
+static const char MAGIC[4] = {'S','N','K','L'};
+static const uint8_t VERSION = 1;
+
+static void putU(std::ostream& out, uint64_t v, int bytes) {
+    for (int i=0;i<bytes;i++) out.put((char)(v >> (8*i)));
+}
+
+static bool getU(std::istream& in, uint64_t& v, int bytes) {
+    v = 0;
+    for (int i=0;i<bytes;i++) {
+        int c = in.get();
+        if (c == EOF) return false;
+        v |= (uint64_t)(uint8_t)c << (8*i);
+    }
+    return true;
+}
+
+bool GameLogWriter::open(const std::string& path, const GameConfig& config, uint64_t seed) {
+    out_.open(path, std::ios::binary | std::ios::trunc);
+    if (!out_) return false;
+    out_.write(MAGIC, 4); out_.put((char)VERSION);
+    putU(out_, seed, 8);
+    putU(out_, config.width(), 4); putU(out_, config.height(), 4);
+    putU(out_, config.food_static(), 4); putU(out_, config.state_delay_ms(), 4);
+    return (bool)out_.flush();
+}
+
+void GameLogWriter::record(int op, int id) {
+    out_.put((char)op);
+    uint32_t v = (uint32_t)id;
+    while (v >= 0x80) { out_.put((char)(v | 0x80)); v >>= 7; }
+    out_.put((char)v);
+}
+
+long replayGameLog(const std::string& path, Game& game, std::string& error,
+                   const std::function<void()>& onTick) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) { error = path + ": cannot open"; return -1; }
+    char magic[4]; uint64_t seed, w, h, food, delay;
+    if (!in.read(magic, 4) || !std::equal(magic, magic+4, MAGIC) || in.get() != VERSION
+        || !getU(in, seed, 8) || !getU(in, w, 4) || !getU(in, h, 4) || !getU(in, food, 4) || !getU(in, delay, 4)) {
+        error = path + ": not a snake game log";
+        return -1;
+    }
+    GameConfig cfg;
+    cfg.set_width((int)w); cfg.set_height((int)h);
+    cfg.set_food_static((int)food); cfg.set_state_delay_ms((int)delay);
+    game.init(cfg, seed);
+
+    std::vector<int> ate, died;
+    long ticks = 0;
+    for (int op; (op = in.get()) != EOF; ) {
+        if (op == GameLogWriter::TICK) {
+            game.tick(ate, died); ticks++;
+            if (onTick) onTick();
+            continue;
+        }
+        uint32_t id = 0;
+        for (int shift=0, c; ; shift += 7) {
+            if ((c = in.get()) == EOF) return ticks; // cut short by a crash, keep what we have
+            id |= (uint32_t)(c & 0x7f) << shift;
+            if (!(c & 0x80)) break;
+        }
+        if (op == GameLogWriter::JOIN) game.addLocalPlayer("", (int)id);
+        else if (op == GameLogWriter::LEAVE) game.removeLocalPlayer((int)id);
+        else if (op >= GameLogWriter::STEER && Direction_IsValid(op - GameLogWriter::STEER)) game.steer((int)id, (Direction)(op - GameLogWriter::STEER));
+        else { error = path + ": bad record"; return -1; }
+    }
+    return ticks;
+}
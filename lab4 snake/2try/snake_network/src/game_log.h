@@ -0,0 +1,39 @@
+#pragma once
+#include "snakes.pb.h"
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+
+using namespace snakes;
+
+class Game;
+
+// Binary log of everything that feeds a Game: its config and seed, then every
+// join, leave, steer and tick in call order. With the seeded engine that is
+// enough to replay a game exactly, e.g. to reproduce a desync or as a fixed
+// benchmark workload.
+//
+// Layout, little endian: "SNKL", u8 version, u64 seed, u32 width, height,
+// food_static, state_delay_ms; then records of one op byte followed by the
+// player id as a varint (none for TICK). Steers carry the direction in the op.
+class GameLogWriter {
+public:
+    bool open(const std::string& path, const GameConfig& config, uint64_t seed);
+    void join(int id) { record(JOIN, id); }
+    void leave(int id) { record(LEAVE, id); }
+    void steer(int id, Direction d) { record(STEER + d, id); }
+    void tick() { out_.put((char)TICK); out_.flush(); } // whole ticks on disk if we crash
+
+    enum Op : uint8_t { TICK = 0, JOIN = 1, LEAVE = 2, STEER = 3 /* + Direction */ };
+
+private:
+    void record(int op, int id);
+    std::ofstream out_;
+};
+
+// Replays `path` into `game` as fast as it goes, calling onTick after every
+// tick. Returns the number of ticks, or -1 (with the reason in error) for a
+// file that isn't a game log.
+long replayGameLog(const std::string& path, Game& game, std::string& error,
+                   const std::function<void()>& onTick = {});
@@ -1,14 +1,18 @@
 #include <SFML/Graphics.hpp>
 #include "net.h"
 #include "game.h"
+#include "profiler.h"
 #include "snakes.pb.h"
 
 #include <thread>
 #include <mutex>
 #include <atomic>
 #include <chrono>
+#include <cstdio>
 #include <iostream>
 #include <map>
+#include <optional>
+#include <string>
 #include <vector>
 #define MULTICAST_IP "239.192.0.4"
 #define MULTICAST_PORT 9192
@@ -19,6 +23,7 @@ using namespace snakes;
 // ---------- Global constants ----------
 const int CELL_PIXEL = 20;
 const int SCOREBOARD_WIDTH = 220;
+const int STATS_DUMP_SEC = 5;
 
 // ---------- Utility ----------
 sf::Color playerColor(int id) {
@@ -29,6 +34,26 @@ sf::Color playerColor(int id) {
     return cols[id % cols.size()];
 }
 
+// ---------- Profiling ----------
+// Per-phase timings of the master's tick loop and of the render loop: F3 shows
+// them over the field, and every STATS_DUMP_SEC they go to stderr and start over.
+// Phases nest (scores includes its players_mtx waits, tick loop everything).
+struct Profile {
+    // tick thread
+    PhaseStats wakeLate{"wake late"}, gameLock{"game_mtx wait"}, playersLock{"players_mtx wait"},
+               tick{"tick()"}, scores{"scores"}, proto{"toProto()"}, serialize{"serialize"},
+               send{"sendTo all"}, loop{"tick loop"};
+    atomic<uint64_t> overruns{0}; // ticks done after the next one was due, since start
+    // render loop
+    PhaseStats uiLock{"game_mtx wait (ui)"}, events{"events"}, snapshot{"snapshot"},
+               draw{"draw"}, display{"display"}, frame{"frame"};
+
+    vector<PhaseStats*> all() {
+        return {&wakeLate, &gameLock, &playersLock, &tick, &scores, &proto, &serialize, &send, &loop,
+                &uiLock, &events, &snapshot, &draw, &display, &frame};
+    }
+};
+
 // ---------- Application ----------
 int main(int argc, char** argv) {
     GOOGLE_PROTOBUF_VERIFY_VERSION;
@@ -42,6 +67,8 @@ int main(int argc, char** argv) {
 
     Game masterGame;
     masterGame.initDefault();
+    // argv[3]: record every game input to this log; snake_bench -r replays it
+    if (as_master && argc>3 && !masterGame.recordTo(argv[3])) { perror(argv[3]); return 1; }
     // copy config once — we'll still lock when reading masterGame, but keep cfg for UI dims
     GameConfig cfg = masterGame.getConfig();
 
@@ -67,6 +94,8 @@ int main(int argc, char** argv) {
 
     atomic<int64_t> g_msg_seq(1);
 
+    Profile prof;
+
     // For clients: discovered master address (ip/port)
     mutex discovered_mtx;
     NetAddress discoveredMaster{"", 0};
@@ -123,84 +152,32 @@ int main(int argc, char** argv) {
             else if (gm.has_join()) {
                 if (as_master) {
                     const auto& j = gm.join();
-                    int w, h;
-                    { // read config safely
+                    int new_id = 2000 + (int)(chrono::system_clock::now().time_since_epoch().count()%100000);
+                    // движок сам ищет свободный квадрат 5x5 (см. Game::addLocalPlayer)
+                    int rc;
+                    {
                         lock_guard<mutex> g(game_mtx);
-                        w = masterGame.getConfig().width();
-                        h = masterGame.getConfig().height();
+                        rc = masterGame.addLocalPlayer(j.player_name(), new_id);
                     }
-                    bool placed = false;
-                    int new_id = 2000 + (int)(chrono::system_clock::now().time_since_epoch().count()%100000);
-                    for (int yy=0; yy<h && !placed; ++yy) {
-                        for (int xx=0; xx<w && !placed; ++xx) {
-                            bool ok = true;
-                            vector<Coord> cells;
-                            for (int dy=0; dy<5 && ok; ++dy) for (int dx=0; dx<5 && ok; ++dx) {
-                                int cx = (xx+dx)%w, cy = (yy+dy)%h;
-                                cells.push_back({cx,cy});
-                            }
-                            ok = true;
-                            GameState gs;
-                            { lock_guard<mutex> g(game_mtx); gs = masterGame.toProto(0); }
-                            for (auto &c: cells) {
-                                bool occ=false;
-                                for (int si=0; si<gs.snakes_size(); ++si) {
-                                    const auto &s = gs.snakes(si);
-                                    for (int pi=0; pi<s.points_size(); ++pi) {
-                                        const auto &p = s.points(pi);
-                                        if (p.x()==c.x && p.y()==c.y) { occ=true; break; }
-                                    }
-                                    if (occ) break;
-                                }
-                                for (int fi=0; fi<gs.foods_size(); ++fi) {
-                                    const auto &f = gs.foods(fi);
-                                    if (f.x()==c.x && f.y()==c.y) { occ=true; break; }
-                                }
-                                if (occ) { ok = false; break; }
-                            }
-                            if (!ok) continue;
-
-                            int cx = (xx+2)%w, cy = (yy+2)%h;
-                            Coord head{cx,cy};
-                            vector<Coord> nbrs = {{(cx+1)%w,cy},{(cx-1+w)%w,cy},{cx,(cy+1)%h},{cx,(cy-1+h)%h}};
-                            Coord tail = nbrs[rand()%4];
-
-                            bool bad=false;
-                            for (int fi=0; fi<gs.foods_size(); ++fi) {
-                                const auto &f = gs.foods(fi);
-                                if ((f.x()==head.x && f.y()==head.y) || (f.x()==tail.x && f.y()==tail.y)) { bad=true; break; }
-                            }
-                            if (bad) continue;
-
-                            int rc;
-                            {
-                                lock_guard<mutex> g(game_mtx);
-                                rc = masterGame.addLocalPlayer(j.player_name(), new_id);
-                            }
-                            if (rc==0) {
-                                GamePlayer gp; gp.set_id(new_id); gp.set_name(j.player_name()); gp.set_role(NodeRole::NORMAL); gp.set_score(0);
-                                gp.set_ip_address(sender.ip); gp.set_port(sender.port);
-                                {
-                                    lock_guard<mutex> lg(players_mtx);
-                                    players[new_id] = gp;
-                                    playerAddr[new_id] = sender;
-                                }
-                                // добавляем в allScores с 0 очков
-                                {
-                                    lock_guard<mutex> lg(allScores_mtx);
-                                    allScores[new_id] = gp;
-                                }
-                                GameMessage ack; ack.set_msg_seq(g_msg_seq++);
-                                ack.set_receiver_id(new_id);
-                                ack.mutable_ack();
-                                net.sendTo(ack, sender);
-                                cerr << "Accepted join from " << j.player_name() << " id=" << new_id << " addr=" << sender.ip << ":" << sender.port << "\n";
-                                placed = true;
-                                break;
-                            }
+                    if (rc==0) {
+                        GamePlayer gp; gp.set_id(new_id); gp.set_name(j.player_name()); gp.set_role(NodeRole::NORMAL); gp.set_score(0);
+                        gp.set_ip_address(sender.ip); gp.set_port(sender.port);
+                        {
+                            lock_guard<mutex> lg(players_mtx);
+                            players[new_id] = gp;
+                            playerAddr[new_id] = sender;
                         }
-                    }
-                    if (!placed) {
+                        // добавляем в allScores с 0 очков
+                        {
+                            lock_guard<mutex> lg(allScores_mtx);
+                            allScores[new_id] = gp;
+                        }
+                        GameMessage ack; ack.set_msg_seq(g_msg_seq++);
+                        ack.set_receiver_id(new_id);
+                        ack.mutable_ack();
+                        net.sendTo(ack, sender);
+                        cerr << "Accepted join from " << j.player_name() << " id=" << new_id << " addr=" << sender.ip << ":" << sender.port << "\n";
+                    } else {
                         GameMessage err; err.set_msg_seq(g_msg_seq++);
                         err.mutable_error()->set_error_message("No place available");
                         net.sendTo(err, sender);
@@ -284,16 +261,28 @@ int main(int argc, char** argv) {
     if (as_master) {
         tickThread = thread([&](){
             int64_t state_order = 1;
+            // ticks are due every state_delay_ms from the first one on, however
+            // long each takes; one that ends after the next was due is an overrun
+            auto due = chrono::steady_clock::now();
             while (true) {
                 int delay;
-                { lock_guard<mutex> g(game_mtx); delay = masterGame.getConfig().state_delay_ms(); }
-                this_thread::sleep_for(chrono::milliseconds(delay));
+                { auto g = timedLock(game_mtx, prof.gameLock); delay = masterGame.getConfig().state_delay_ms(); }
+                due += chrono::milliseconds(delay);
+                this_thread::sleep_until(due);
+                auto woke = chrono::steady_clock::now();
+                prof.wakeLate.add(woke - due);
+
                 vector<int> ate, died;
-                { lock_guard<mutex> g(game_mtx); masterGame.tick(ate, died); }
+                {
+                    auto g = timedLock(game_mtx, prof.gameLock);
+                    PhaseTimer t(prof.tick);
+                    masterGame.tick(ate, died);
+                }
 
+                auto scoresStart = chrono::steady_clock::now();
                 // Обновляем очки живых игроков
                 {
-                    lock_guard<mutex> lg(players_mtx);
+                    auto lg = timedLock(players_mtx, prof.playersLock);
                     for (int id: ate) {
                         if (players.count(id)) players[id].set_score(players[id].score() + 1);
                     }
@@ -301,7 +290,7 @@ int main(int argc, char** argv) {
 
                 // Обновляем allScores рекорды
                 {
-                    lock_guard<mutex> lg(players_mtx);
+                    auto lg = timedLock(players_mtx, prof.playersLock);
                     lock_guard<mutex> lg2(allScores_mtx);
                     for (int id : ate) {
                         if (players.count(id)) {
@@ -317,7 +306,7 @@ int main(int argc, char** argv) {
 
                 // remove players whose snakes died, но сохраняем их рекорды
                 if (!died.empty()) {
-                    lock_guard<mutex> lg(players_mtx);
+                    auto lg = timedLock(players_mtx, prof.playersLock);
                     lock_guard<mutex> lg2(allScores_mtx);
                     for (int did : died) {
                         if (players.count(did)) {
@@ -334,32 +323,52 @@ int main(int argc, char** argv) {
                         cerr << "Player " << did << " removed after death\n";
                     }
                 }
+                prof.scores.add(chrono::steady_clock::now() - scoresStart);
 
                 GameState gs;
                 {
-                    lock_guard<mutex> g(game_mtx);
+                    auto g = timedLock(game_mtx, prof.gameLock);
+                    PhaseTimer t(prof.proto);
                     gs = masterGame.toProto(state_order++);
                 }
-                GamePlayers* gps = gs.mutable_players();
+                GameMessage gm;
+                string buf;
                 {
-                    lock_guard<mutex> lg(players_mtx);
-                    for (auto &pr: players) *gps->add_players() = pr.second;
+                    PhaseTimer t(prof.serialize);
+                    GamePlayers* gps = gs.mutable_players();
+                    {
+                        auto lg = timedLock(players_mtx, prof.playersLock);
+                        for (auto &pr: players) *gps->add_players() = pr.second;
+                    }
+                    gm.set_msg_seq(g_msg_seq++);
+                    gm.mutable_state()->mutable_state()->CopyFrom(gs);
+                    buf = gm.SerializeAsString(); // once for all recipients
                 }
-                GameMessage gm; gm.set_msg_seq(g_msg_seq++);
-                gm.mutable_state()->mutable_state()->CopyFrom(gs);
 
                 vector<pair<int,NetAddress>> recipients;
                 {
-                    lock_guard<mutex> lg(players_mtx);
+                    auto lg = timedLock(players_mtx, prof.playersLock);
                     for (auto &pr: playerAddr) recipients.push_back(pr);
                 }
-                for (auto &p : recipients) net.sendTo(gm, p.second);
+                {
+                    PhaseTimer t(prof.send);
+                    for (auto &p : recipients) net.sendBytes(buf, p.second);
+                }
 
                 {
                     lock_guard<mutex> lg(state_mtx);
                     currentState = gs;
                     last_state_order = gs.state_order();
                 }
+
+                auto done = chrono::steady_clock::now();
+                prof.loop.add(done - woke);
+                if (done > due + chrono::milliseconds(delay)) {
+                    prof.overruns++;
+                    cerr << "Tick " << gs.state_order() << " overran: done "
+                         << chrono::duration<double, milli>(done - due).count() << " ms after it was due (delay " << delay << " ms)\n";
+                    due = done; // don't try to catch up with a burst of ticks
+                }
             }
         });
         tickThread.detach();
@@ -380,6 +389,23 @@ int main(int argc, char** argv) {
         }
     }
 
+    // Stats dump: every STATS_DUMP_SEC print what the phases took since the last one
+    thread statsThread([&](){
+        while (true) {
+            this_thread::sleep_for(chrono::seconds(STATS_DUMP_SEC));
+            string out = "--- timings, last " + to_string(STATS_DUMP_SEC) + " s";
+            if (as_master) out += ", tick overruns so far " + to_string(prof.overruns.load());
+            out += " ---\n";
+            for (auto *ps: prof.all()) {
+                if (!ps->count()) continue;
+                out += ps->summary() + "\n";
+                ps->reset();
+            }
+            cerr << out;
+        }
+    });
+    statsThread.detach();
+
     // Setup SFML window
     int winW = cfg.width() * CELL_PIXEL + SCOREBOARD_WIDTH;
     int winH = cfg.height() * CELL_PIXEL;
@@ -390,10 +416,19 @@ int main(int argc, char** argv) {
     }
 
     // Main UI loop
+    bool showProfile = false; // F3
+    auto frameStart = chrono::steady_clock::now();
     while (window.isOpen()) {
+        auto now = chrono::steady_clock::now();
+        prof.frame.add(now - frameStart); // the whole previous iteration, sleep included
+        frameStart = now;
+        optional<PhaseTimer> phase; // one phase of this frame after another
+
+        phase.emplace(prof.events);
         sf::Event ev;
         while (window.pollEvent(ev)) {
             if (ev.type == sf::Event::Closed) { window.close(); break; }
+            if (ev.type == sf::Event::KeyPressed && ev.key.code == sf::Keyboard::F3) showProfile = !showProfile;
             if (ev.type == sf::Event::KeyPressed) {
                 Direction d;
                 bool send = false;
@@ -423,18 +458,20 @@ int main(int argc, char** argv) {
         }
 
         // render
-        window.clear(sf::Color(30,30,30));
-
+        phase.emplace(prof.snapshot);
         GameState snapshot;
         {
             lock_guard<mutex> lg(state_mtx);
             snapshot = currentState;
         }
         if (as_master) {
-            lock_guard<mutex> g(game_mtx);
+            auto g = timedLock(game_mtx, prof.uiLock);
             snapshot = masterGame.toProto(last_state_order+1);
         }
 
+        phase.emplace(prof.draw);
+        window.clear(sf::Color(30,30,30));
+
         sf::RectangleShape cell(sf::Vector2f((float)CELL_PIXEL-1.0f, (float)CELL_PIXEL-1.0f));
 
         // Draw foods
@@ -502,7 +539,26 @@ int main(int argc, char** argv) {
             window.draw(st);
         }
 
+        if (showProfile) {
+            vector<string> lines;
+            if (as_master) lines.push_back("tick overruns: " + to_string(prof.overruns.load()));
+            for (auto *ps: prof.all()) if (ps->count()) lines.push_back(ps->summary());
+            sf::RectangleShape bg(sf::Vector2f((float)(cfg.width()*CELL_PIXEL), (float)(lines.size()*16 + 10)));
+            bg.setFillColor(sf::Color(0,0,0,190));
+            window.draw(bg);
+            float ly = 5;
+            for (auto &l: lines) {
+                sf::Text t(l, font, 12);
+                t.setFillColor(l.compare(0, 14, "tick overruns:")==0 && prof.overruns.load() ? sf::Color::Red : sf::Color(200,255,200));
+                t.setPosition(5, ly);
+                window.draw(t);
+                ly += 16;
+            }
+        }
+
+        phase.emplace(prof.display);
         window.display();
+        phase.reset();
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
 
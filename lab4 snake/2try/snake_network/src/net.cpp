@@ -50,7 +50,10 @@ void Net::init() {
 }
 
 bool Net::sendTo(const GameMessage& msg, const NetAddress& addr) {
-    std::string buf = msg.SerializeAsString();
+    return sendBytes(msg.SerializeAsString(), addr);
+}
+
+bool Net::sendBytes(const std::string& buf, const NetAddress& addr) {
     struct sockaddr_in dst{};
     dst.sin_family = AF_INET;
     dst.sin_port = htons(addr.port);
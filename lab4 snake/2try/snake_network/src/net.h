@@ -20,6 +20,8 @@ public:
 
     // Отправка (unicast)
     bool sendTo(const snakes::GameMessage& msg, const NetAddress& addr);
+    // То же для уже сериализованного сообщения (одно сообщение многим получателям)
+    bool sendBytes(const std::string& buf, const NetAddress& addr);
 
     // Отправка announcement на multicast (через unicast socket)
     bool sendAnnouncement(const snakes::GameMessage& msg);
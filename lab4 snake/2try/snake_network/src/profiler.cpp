@@ -0,0 +1,38 @@
+#include "profiler.h"
+#include <cstdio>
+
+void PhaseStats::add(std::chrono::steady_clock::duration d) {
+    uint64_t us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    int b = us ? 64 - __builtin_clzll(us) : 0; // samples below 2^b us
+    if (b >= BUCKETS) b = BUCKETS - 1;
+    buckets_[b].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    lastUs_.store(us, std::memory_order_relaxed);
+    uint64_t m = maxUs_.load(std::memory_order_relaxed);
+    while (us > m && !maxUs_.compare_exchange_weak(m, us, std::memory_order_relaxed)) {}
+}
+
+void PhaseStats::reset() {
+    for (auto &b: buckets_) b.store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+    maxUs_.store(0, std::memory_order_relaxed);
+}
+
+double PhaseStats::percentileMs(double q) const {
+    uint64_t n = 0, counts[BUCKETS];
+    for (int b=0; b<BUCKETS; b++) n += counts[b] = buckets_[b].load(std::memory_order_relaxed);
+    if (!n) return 0;
+    uint64_t rank = (uint64_t)(q * (n - 1)), seen = 0;
+    for (int b=0; b<BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > rank) return (1ull << b) / 1000.0;
+    }
+    return (1ull << (BUCKETS - 1)) / 1000.0;
+}
+
+std::string PhaseStats::summary() const {
+    char line[160];
+    snprintf(line, sizeof(line), "%-18s n=%-6llu last %7.2f  p50 <%7.2f  p99 <%7.2f  max %7.2f ms",
+             name_, (unsigned long long)count(), lastMs(), percentileMs(0.5), percentileMs(0.99), maxMs());
+    return line;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Timing of one phase of a loop (tick, toProto, draw, a lock wait...) as a
+// histogram with power-of-two buckets in microseconds: bucket b counts the
+// samples below 2^b us. Lock-free, so the tick thread, the render loop and
+// whoever prints the numbers can share it; a reader racing with add() or
+// reset() may see one sample half-counted, which doesn't matter for display.
+class PhaseStats {
+public:
+    static constexpr int BUCKETS = 24; // the last one takes everything from ~4 s up
+
+    explicit PhaseStats(const char* name) : name_(name) {}
+    const char* name() const { return name_; }
+
+    void add(std::chrono::steady_clock::duration d);
+    void reset();
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    double lastMs() const { return lastUs_.load(std::memory_order_relaxed) / 1000.0; }
+    double maxMs() const { return maxUs_.load(std::memory_order_relaxed) / 1000.0; }
+    // upper edge of the bucket the q-th quantile falls in, 0 without samples
+    double percentileMs(double q) const;
+    // "tick            n=50  last 0.12  p50 0.13  p99 0.51  max 0.61 ms"
+    std::string summary() const;
+
+private:
+    const char* name_;
+    std::atomic<uint64_t> buckets_[BUCKETS] = {};
+    std::atomic<uint64_t> count_{0}, lastUs_{0}, maxUs_{0};
+};
+
+// Adds the time until the end of the scope to a PhaseStats.
+class PhaseTimer {
+public:
+    explicit PhaseTimer(PhaseStats& stats) : stats_(stats), start_(std::chrono::steady_clock::now()) {}
+    ~PhaseTimer() { stats_.add(std::chrono::steady_clock::now() - start_); }
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    PhaseStats& stats_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Locks m and counts the wait in `wait`: lock contention as its own phase.
+template <class Mutex>
+std::unique_lock<Mutex> timedLock(Mutex& m, PhaseStats& wait) {
+    auto t0 = std::chrono::steady_clock::now();
+    std::unique_lock<Mutex> lk(m);
+    wait.add(std::chrono::steady_clock::now() - t0);
+    return lk;
+}
@@ -0,0 +1,90 @@
+// Headless benchmark of Game::tick: no window, no network.
+//
+//   snake_bench                     sweep field sizes and snake counts
+//   snake_bench -f 1000 -n 10000    one square field and snake count
+//   -t ticks                        timed ticks per run (default 200)
+//   -j threads                      tick on a worker pool (default: one thread)
+//   -w log                          record the run's inputs (needs -f and -n)
+//   -r log                          replay a recorded game instead, as fast as it goes
+//
+// Snakes turn at random now and then; the dead are respawned between ticks
+// (outside the timing) so that the snake count stays put. Runs are seeded,
+// so the same arguments give the same workload.
+#include "game.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+struct Result { double mean_ms, p99_ms, max_ms; size_t alive; };
+
+static Result run(int field, int snakes, int ticks, std::shared_ptr<WorkerPool> pool, const char* record) {
+    GameConfig cfg;
+    cfg.set_width(field); cfg.set_height(field);
+    cfg.set_food_static(std::max(3, snakes / 2));
+    cfg.set_state_delay_ms(100);
+    Game game; game.init(cfg, 1); game.setWorkers(pool);
+    if (record && !game.recordTo(record)) { perror(record); exit(1); }
+    for (int id=0; id<snakes; id++) game.addLocalPlayer("", id);
+
+    std::mt19937 rng(12345);
+    std::uniform_int_distribution<int> turn(0, 7), dir(Direction::UP, Direction::RIGHT);
+    std::vector<int> ate, died;
+    std::vector<double> ms;
+    const int warmup = 20;
+    for (int t=0; t<warmup+ticks; t++) {
+        for (int id=0; id<snakes; id++) if (turn(rng)==0) game.steer(id, (Direction)dir(rng));
+        auto t0 = std::chrono::steady_clock::now();
+        game.tick(ate, died);
+        auto t1 = std::chrono::steady_clock::now();
+        if (t >= warmup) ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+        for (int id: died) game.addLocalPlayer("", id);
+    }
+    std::sort(ms.begin(), ms.end());
+    double sum = 0; for (double v: ms) sum += v;
+    if (record) printf("recorded %d ticks to %s, state hash %016llx\n", warmup+ticks, record, (unsigned long long)game.stateHash());
+    return {sum / ms.size(), ms[ms.size()*99/100], ms.back(), (size_t)game.toProto(0).snakes_size()};
+}
+
+int main(int argc, char** argv) {
+    int field = 0, snakes = 0, ticks = 200, threads = 1;
+    const char *record = nullptr, *replay = nullptr;
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-f") && i+1<argc) field = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-n") && i+1<argc) snakes = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-t") && i+1<argc) ticks = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-j") && i+1<argc) threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-w") && i+1<argc) record = argv[++i];
+        else if (!strcmp(argv[i], "-r") && i+1<argc) replay = argv[++i];
+        else { fprintf(stderr, "usage: %s [-f field] [-n snakes] [-t ticks] [-j threads] [-w log | -r log]\n", argv[0]); return 1; }
+    }
+    if (record && !(field && snakes)) { fprintf(stderr, "-w needs -f and -n\n"); return 1; }
+    std::shared_ptr<WorkerPool> pool;
+    if (threads > 1) pool = std::make_shared<WorkerPool>(threads);
+    std::cerr.rdbuf(nullptr); // the engine reports every crash on stderr
+
+    if (replay) {
+        Game game; game.setWorkers(pool);
+        std::string error;
+        auto t0 = std::chrono::steady_clock::now();
+        long n = replayGameLog(replay, game, error);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        if (n < 0) { fprintf(stderr, "%s\n", error.c_str()); return 1; }
+        printf("replayed %ld ticks in %.1f ms (%.0f ticks/s, joins and steers included), state hash %016llx\n",
+               n, ms, n / ms * 1000, (unsigned long long)game.stateHash());
+        return 0;
+    }
+
+    std::vector<int> fields = field ? std::vector<int>{field} : std::vector<int>{100, 250, 500, 1000};
+    std::vector<int> counts = snakes ? std::vector<int>{snakes} : std::vector<int>{100, 1000, 10000};
+    printf("%6s %7s %10s %10s %10s %10s %7s\n", "field", "snakes", "mean ms", "p99 ms", "max ms", "ticks/s", "alive");
+    for (int f: fields) for (int n: counts) {
+        if (!field && !snakes && (long)n * 20 > (long)f * f) continue; // too crowded to be meaningful
+        Result r = run(f, n, ticks, pool, record);
+        printf("%6d %7d %10.3f %10.3f %10.3f %10.0f %7zu\n", f, n, r.mean_ms, r.p99_ms, r.max_ms, 1000 / r.mean_ms, r.alive);
+    }
+    return 0;
+}
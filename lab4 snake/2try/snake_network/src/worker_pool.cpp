@@ -0,0 +1,44 @@
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(unsigned threads) {
+    for (unsigned i=1; i<threads; i++) workers_.emplace_back([this]{ work(); });
+}
+
+WorkerPool::~WorkerPool() {
+    { std::lock_guard<std::mutex> g(m_); stop_ = true; }
+    wake_.notify_all();
+    for (auto &t: workers_) t.join();
+}
+
+void WorkerPool::start(size_t n, void (*call)(void*, size_t), void* ctx) {
+    if (workers_.empty() || n <= 1) { for (size_t i=0; i<n; i++) call(ctx, i); return; }
+    std::lock_guard<std::mutex> turn(runMutex_);
+    {
+        std::lock_guard<std::mutex> g(m_);
+        call_ = call; ctx_ = ctx; n_ = n; next_ = 0;
+        busy_ = workers_.size(); generation_++;
+    }
+    wake_.notify_all();
+    drain();
+    std::unique_lock<std::mutex> lk(m_);
+    done_.wait(lk, [&]{ return busy_ == 0; });
+}
+
+// claims indices until none are left
+void WorkerPool::drain() {
+    for (size_t i; (i = next_.fetch_add(1)) < n_; ) call_(ctx_, i);
+}
+
+void WorkerPool::work() {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lk(m_);
+    for (;;) {
+        wake_.wait(lk, [&]{ return stop_ || generation_ != seen; });
+        if (stop_) return;
+        seen = generation_;
+        lk.unlock();
+        drain();
+        lk.lock();
+        if (--busy_ == 0) done_.notify_one();
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads for data-parallel steps: run(n, fn) calls fn(0..n-1)
+// on the workers and the calling thread and returns once all calls are done.
+// Which thread runs which index is up to the scheduler, so fn(i) may only
+// write state that belongs to index i. Several threads may share a pool:
+// their run() calls take turns, one at a time (so fn must not call run()).
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned threads = std::thread::hardware_concurrency()); // caller included
+    ~WorkerPool();
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    size_t size() const { return workers_.size() + 1; }
+
+    template <class F> void run(size_t n, F&& fn) {
+        // fn lives on the caller's stack until run() returns, no copy needed
+        start(n, [](void* f, size_t i) { (*static_cast<F*>(f))(i); }, &fn);
+    }
+
+private:
+    void start(size_t n, void (*call)(void*, size_t), void* ctx);
+    void drain();
+    void work();
+
+    std::vector<std::thread> workers_;
+    std::mutex runMutex_; // held for a whole run(), callers take turns
+    std::mutex m_;
+    std::condition_variable wake_, done_;
+    uint64_t generation_ = 0; // bumped per run(), wakes the workers
+    size_t busy_ = 0;         // workers still inside the current run
+    bool stop_ = false;
+
+    void (*call_)(void*, size_t) = nullptr;
+    void* ctx_ = nullptr;
+    size_t n_ = 0;
+    std::atomic<size_t> next_{0};
+};
@@ -45,6 +45,9 @@ struct Client {
 
     bool client_eof = false;
     bool remote_eof = false;
+    // выставляются после shutdown(SHUT_WR) на противоположной стороне
+    bool remote_wr_shut = false;
+    bool client_wr_shut = false;
 
     std::vector<uint8_t> sock_buf;
 
@@ -212,9 +215,7 @@ void close_client(int fd) {
     if (it != clients.end()) {
         Client* c = it->second;
         clients.erase(it);
-        if (c->remote_fd != -1) close(c->remote_fd);
-        close(c->client_fd);
-        delete c;
+        delete c; // дескрипторы закрывает ~Client()
     }
 }
 
@@ -354,9 +355,24 @@ void handle_dns_response() {
     c->state = ST_CONNECTING;
 }
 
+// Пробрасывает полузакрытие: как только одна сторона прислала EOF и всё,
+// что от неё успели прочитать, ушло на другую сторону, закрываем запись
+// на другой стороне, чтобы она тоже увидела EOF.
+bool propagate_half_close(Client* c) {
+    if (c->client_eof && c->c2r_buf.empty() && !c->remote_wr_shut) {
+        if (shutdown(c->remote_fd, SHUT_WR) < 0 && errno != ENOTCONN) return false;
+        c->remote_wr_shut = true;
+    }
+    if (c->remote_eof && c->r2c_buf.empty() && !c->client_wr_shut) {
+        if (shutdown(c->client_fd, SHUT_WR) < 0 && errno != ENOTCONN) return false;
+        c->client_wr_shut = true;
+    }
+    return true;
+}
+
 void process_relay(Client* c, fd_set &read_fds, fd_set &write_fds) {
     // client -> remote
-    if (FD_ISSET(c->client_fd, &read_fds) && c->c2r_buf.size() < MAX_BUF) {
+    if (!c->client_eof && FD_ISSET(c->client_fd, &read_fds) && c->c2r_buf.size() < MAX_BUF) {
         uint8_t buf[4096];
         ssize_t n = recv(c->client_fd, buf, sizeof(buf), 0);
         if (n > 0) c->c2r_buf.insert(c->c2r_buf.end(), buf, buf + n);
@@ -364,13 +380,13 @@ void process_relay(Client* c, fd_set &read_fds, fd_set &write_fds) {
         else if (errno != EAGAIN && errno != EWOULDBLOCK) { close_client(c->client_fd); return; }
     }
     if (FD_ISSET(c->remote_fd, &write_fds) && !c->c2r_buf.empty()) {
-        ssize_t n = send(c->remote_fd, c->c2r_buf.data(), c->c2r_buf.size(), 0);
+        ssize_t n = send(c->remote_fd, c->c2r_buf.data(), c->c2r_buf.size(), MSG_NOSIGNAL);
         if (n > 0) c->c2r_buf.erase(c->c2r_buf.begin(), c->c2r_buf.begin() + n);
         else if (errno != EAGAIN && errno != EWOULDBLOCK) { close_client(c->client_fd); return; }
     }
 
     // remote -> client
-    if (FD_ISSET(c->remote_fd, &read_fds) && c->r2c_buf.size() < MAX_BUF) {
+    if (!c->remote_eof && FD_ISSET(c->remote_fd, &read_fds) && c->r2c_buf.size() < MAX_BUF) {
         uint8_t buf[4096];
         ssize_t n = recv(c->remote_fd, buf, sizeof(buf), 0);
         if (n > 0) c->r2c_buf.insert(c->r2c_buf.end(), buf, buf + n);
@@ -378,12 +394,17 @@ void process_relay(Client* c, fd_set &read_fds, fd_set &write_fds) {
         else if (errno != EAGAIN && errno != EWOULDBLOCK) { close_client(c->client_fd); return; }
     }
     if (FD_ISSET(c->client_fd, &write_fds) && !c->r2c_buf.empty()) {
-        ssize_t n = send(c->client_fd, c->r2c_buf.data(), c->r2c_buf.size(), 0);
+        ssize_t n = send(c->client_fd, c->r2c_buf.data(), c->r2c_buf.size(), MSG_NOSIGNAL);
         if (n > 0) c->r2c_buf.erase(c->r2c_buf.begin(), c->r2c_buf.begin() + n);
         else if (errno != EAGAIN && errno != EWOULDBLOCK) { close_client(c->client_fd); return; }
     }
 
-    if (c->client_eof && c->remote_eof && c->c2r_buf.empty() && c->r2c_buf.empty()) {
+    if (!propagate_half_close(c)) {
+        close_client(c->client_fd);
+        return;
+    }
+
+    if (c->remote_wr_shut && c->client_wr_shut) {
         close_client(c->client_fd);
     }
 }
@@ -430,14 +451,16 @@ int main(int argc, char* argv[]) {
 
         for (auto& p : clients) {
             Client* c = p.second;
-            if (c->state == ST_HANDSHAKE || c->state == ST_REQUEST || c->state == ST_DNS_WAIT || c->state == ST_RELAY) {
+            if (c->state == ST_HANDSHAKE || c->state == ST_REQUEST || c->state == ST_DNS_WAIT ||
+                (c->state == ST_RELAY && !c->client_eof)) {
                 FD_SET(c->client_fd, &read_fds);
                 maxfd = std::max(maxfd, c->client_fd);
             }
             if (c->state == ST_CONNECTING || c->state == ST_RELAY) {
                 if (c->remote_fd != -1) {
                     if (c->state == ST_CONNECTING) FD_SET(c->remote_fd, &write_fds);
-                    else {
+                    else if (!c->remote_eof) {
+                        // после EOF сокет всегда "читаем" — не держим его в наборе, иначе select крутится вхолостую
                         FD_SET(c->remote_fd, &read_fds);
                         maxfd = std::max(maxfd, c->remote_fd);
                     }
@@ -474,9 +497,14 @@ int main(int argc, char* argv[]) {
             handle_dns_response();
         }
 
-        std::vector<int> to_close;
-        for (auto& p : clients) {
-            Client* c = p.second;
+        // close_client() удаляет из clients, поэтому обходим снимок дескрипторов
+        std::vector<int> fds;
+        fds.reserve(clients.size());
+        for (auto& p : clients) fds.push_back(p.first);
+        for (int fd : fds) {
+            auto it = clients.find(fd);
+            if (it == clients.end()) continue;
+            Client* c = it->second;
             if (c->state == ST_HANDSHAKE) {
                 handle_socks5_handshake(c);
             } else if (c->state == ST_REQUEST) {